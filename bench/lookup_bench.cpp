@@ -0,0 +1,155 @@
+//
+// Micro-benchmark for symbol and operator lookups in the ToyC front end.
+//
+// Compares the original strategies (a std::map<std::string, Value*> probed with
+// operator[] on every variable reference, and a std::map<char, int> probed for
+// every operator token) with the current ones (names resolved to slots once at
+// parse time through interned pointers, then a dense vector index in codegen,
+// and a 256-entry precedence table).
+//
+// Build: cmake --build build --target toyc-lookup-bench
+// Run:   ./toyc-lookup-bench [references-per-function]
+//
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Value {}; // Stands in for llvm::Value; only pointers are stored.
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedNs(Clock::time_point Start, Clock::time_point End) {
+    return std::chrono::duration<double, std::nano>(End - Start).count();
+}
+
+// Keeps the optimizer from discarding the lookups.
+volatile uintptr_t Sink;
+
+// One function with NumParams parameters whose body references them NumRefs
+// times in a random order.
+struct Workload {
+    std::vector<std::string> Params;
+    std::vector<unsigned> References;
+};
+
+Workload makeWorkload(unsigned NumParams, unsigned NumRefs) {
+    Workload W;
+    for (unsigned I = 0; I != NumParams; ++I)
+        W.Params.push_back("param" + std::to_string(I));
+
+    std::mt19937 Rng(42);
+    std::uniform_int_distribution<unsigned> Pick(0, NumParams - 1);
+    for (unsigned I = 0; I != NumRefs; ++I)
+        W.References.push_back(Pick(Rng));
+    return W;
+}
+
+// Baseline: NamedValues[std::string(Name)] for every reference.
+double benchStringMap(const Workload &W, std::vector<Value> &Args) {
+    std::map<std::string, Value *> NamedValues;
+    for (unsigned I = 0; I != W.Params.size(); ++I)
+        NamedValues[W.Params[I]] = &Args[I];
+
+    auto Start = Clock::now();
+    for (unsigned Ref : W.References)
+        Sink = (uintptr_t)NamedValues[std::string(W.Params[Ref])];
+    return elapsedNs(Start, Clock::now());
+}
+
+// Current: the parser maps each interned identifier to a slot once per
+// reference, and codegen just indexes a vector. Interning itself happens in
+// both schemes, so it is done up front and not timed.
+void benchSlots(const Workload &W, std::vector<Value> &Args, double &ResolveNs, double &CodegenNs) {
+    llvm::BumpPtrAllocator Allocator;
+    llvm::UniqueStringSaver Identifiers(Allocator);
+
+    std::vector<const char *> Interned;
+    for (auto &Param : W.Params)
+        Interned.push_back(Identifiers.save(Param).data());
+    std::vector<const char *> RefNames;
+    for (unsigned Ref : W.References)
+        RefNames.push_back(Identifiers.save(W.Params[Ref]).data());
+
+    auto Start = Clock::now();
+    llvm::DenseMap<const char *, unsigned> ScopeSlots;
+    for (unsigned I = 0; I != Interned.size(); ++I)
+        ScopeSlots[Interned[I]] = I;
+
+    std::vector<unsigned> Slots;
+    Slots.reserve(RefNames.size());
+    for (const char *Name : RefNames)
+        Slots.push_back(ScopeSlots.find(Name)->second);
+    auto Resolved = Clock::now();
+
+    std::vector<Value *> SlotValues;
+    for (auto &Arg : Args)
+        SlotValues.push_back(&Arg);
+    for (unsigned Slot : Slots)
+        Sink = (uintptr_t)SlotValues[Slot];
+
+    ResolveNs = elapsedNs(Start, Resolved);
+    CodegenNs = elapsedNs(Resolved, Clock::now());
+}
+
+void benchPrecedence(unsigned NumTokens) {
+    const char Ops[] = {'+', '-', '*', '<', ')', ',', 'x'};
+    std::mt19937 Rng(7);
+    std::uniform_int_distribution<unsigned> Pick(0, sizeof(Ops) - 1);
+    std::vector<int> Tokens;
+    for (unsigned I = 0; I != NumTokens; ++I)
+        Tokens.push_back(Ops[Pick(Rng)]);
+
+    std::map<char, int> MapPrec{{'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}};
+    int TablePrec[256] = {};
+    TablePrec['<'] = 10;
+    TablePrec['+'] = 20;
+    TablePrec['-'] = 20;
+    TablePrec['*'] = 40;
+
+    auto Start = Clock::now();
+    for (int Tok : Tokens)
+        Sink = MapPrec[Tok];
+    double MapNs = elapsedNs(Start, Clock::now());
+
+    Start = Clock::now();
+    for (int Tok : Tokens)
+        Sink = (Tok < 0 || Tok > 255) ? -1 : TablePrec[Tok];
+    double TableNs = elapsedNs(Start, Clock::now());
+
+    std::printf("\n%-16s %12s %12s %10s\n", "operators", "map ns/tok", "table ns/tok", "speedup");
+    std::printf("%-16s %12.2f %12.2f %9.1fx\n", "precedence",
+                MapNs / NumTokens, TableNs / NumTokens, MapNs / TableNs);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    unsigned NumRefs = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+
+    std::printf("%-16s %12s %12s %12s %10s\n", "parameters", "map ns/ref", "resolve ns", "codegen ns",
+                "speedup");
+    for (unsigned NumParams : {2u, 8u, 32u, 128u, 512u}) {
+        Workload W = makeWorkload(NumParams, NumRefs);
+        std::vector<Value> Args(NumParams);
+
+        double MapNs = benchStringMap(W, Args);
+        double ResolveNs, CodegenNs;
+        benchSlots(W, Args, ResolveNs, CodegenNs);
+
+        std::printf("%-16u %12.2f %12.2f %12.2f %9.1fx\n", NumParams, MapNs / NumRefs,
+                    ResolveNs / NumRefs, CodegenNs / NumRefs, MapNs / (ResolveNs + CodegenNs));
+    }
+
+    benchPrecedence(NumRefs);
+    return 0;
+}
@@ -0,0 +1,376 @@
+//
+// Throughput benchmarks for the ToyC compiler and for the code it generates.
+//
+// Compile benchmarks generate deterministic synthetic programs (deep
+// expressions, a wide call graph, many-argument prototypes, and many short
+// lines), compile each one with `toyc --stats-json-file`, and report lexer
+// MB/s, parser nodes/s, codegen functions/s, end-to-end time and peak RSS.
+// Runtime benchmarks call the --batch entry points of bench/kernels.toy,
+// which toyc compiles and the build links into this binary, next to the
+// same loops written in C++.
+//
+// Results can be written as JSON and compared with an earlier run; any
+// metric that got worse by more than the tolerance makes the run fail.
+//
+// Build:    cmake --build build --target toyc-bench
+// Run:      ./toyc-bench [--scale=N] [--json=out.json] [--baseline=base.json]
+// Generate: ./toyc-bench --generate=<deep|wide|args|lines> [--scale=N] > file.toy
+//
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C" {
+// Generated by toyc from bench/kernels.toy.
+void average_batch(const int32_t *X, const int32_t *Y, int32_t *Out, intptr_t N);
+void discount_batch(const double *Price, const double *Rate, double *Out, intptr_t N);
+void horner_batch(const double *X, double *Out, intptr_t N);
+void clamp_batch(const int64_t *X, const int64_t *Lo, const int64_t *Hi, int64_t *Out, intptr_t N);
+}
+
+namespace {
+
+llvm::cl::opt<unsigned> Scale("scale",
+        llvm::cl::desc("Multiply every workload's size (100 gives about two million lines)"),
+        llvm::cl::init(1));
+
+llvm::cl::opt<std::string> Toyc("toyc", llvm::cl::desc("Compiler to benchmark"),
+        llvm::cl::value_desc("path"), llvm::cl::init(TOYC_PATH));
+
+llvm::cl::opt<std::string> JSONOutput("json", llvm::cl::desc("Write the results as JSON"),
+        llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<std::string> Baseline("baseline",
+        llvm::cl::desc("Compare with the results of an earlier --json run"),
+        llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<double> Tolerance("tolerance",
+        llvm::cl::desc("Percentage by which a metric may get worse before it counts as a regression"),
+        llvm::cl::init(10));
+
+llvm::cl::opt<std::string> Generate("generate",
+        llvm::cl::desc("Print the program of one workload instead of running the benchmarks"),
+        llvm::cl::value_desc("workload"));
+
+using Clock = std::chrono::steady_clock;
+
+double elapsedSeconds(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+// A fixed LCG rather than <random>, whose distributions differ between
+// standard libraries; every platform generates the same programs.
+class Rng {
+    uint64_t State;
+public:
+    explicit Rng(uint64_t Seed) : State(Seed) {}
+    unsigned below(unsigned N) {
+        State = State * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned)(State >> 33) % N;
+    }
+};
+
+const char Ops[] = {'+', '-', '*'};
+
+// Single functions with expressions thousands of nodes deep and long.
+void generateDeep(llvm::raw_ostream &OS, unsigned Scale) {
+    Rng R(1);
+    for (unsigned F = 0; F != 20 * Scale; ++F) {
+        OS << "def deep" << F << "(x y) ";
+        for (unsigned I = 0; I != 300; ++I)
+            OS << '(';
+        OS << 'x';
+        for (unsigned I = 0; I != 300; ++I)
+            OS << ' ' << Ops[R.below(3)] << ' ' << (R.below(2) ? "y" : "3") << ')';
+        for (unsigned I = 0; I != 3000; ++I)
+            OS << ' ' << Ops[R.below(3)] << ' ' << (R.below(2) ? "x" : "y");
+        OS << "\n";
+    }
+}
+
+// Many small functions, each calling two random earlier ones.
+void generateWide(llvm::raw_ostream &OS, unsigned Scale) {
+    Rng R(2);
+    OS << "def wide0(a b) a * b + 1\n";
+    for (unsigned F = 1; F != 2000 * Scale; ++F)
+        OS << "def wide" << F << "(a b) wide" << R.below(F) << "(a, b + " << F << ") "
+           << Ops[R.below(3)] << " wide" << R.below(F) << "(b, a)\n";
+}
+
+// 64-parameter prototypes, and calls that pass 64 arguments.
+void generateArgs(llvm::raw_ostream &OS, unsigned Scale) {
+    Rng R(3);
+    const unsigned NumParams = 64;
+    for (unsigned F = 0; F != 500 * Scale; ++F) {
+        OS << "def args" << F << "(";
+        for (unsigned P = 0; P != NumParams; ++P)
+            OS << (P ? " p" : "p") << P;
+        OS << ") ";
+        for (unsigned I = 0; I != 16; ++I)
+            OS << (I ? " + p" : "p") << R.below(NumParams) << " * p" << R.below(NumParams);
+        if (F) {
+            OS << " + args" << R.below(F) << "(";
+            for (unsigned P = 0; P != NumParams; ++P)
+                OS << (P ? ", p" : "p") << R.below(NumParams);
+            OS << ")";
+        }
+        OS << "\n";
+    }
+}
+
+// One short definition per line; this is the one to scale up.
+void generateLines(llvm::raw_ostream &OS, unsigned Scale) {
+    Rng R(4);
+    for (unsigned F = 0; F != 20000 * Scale; ++F)
+        OS << "def line" << F << "(x y) (x + " << R.below(1000) << ") * (y - " << R.below(1000)
+           << ") + x * y\n";
+}
+
+struct Workload {
+    const char *Name;
+    void (*Generate)(llvm::raw_ostream &, unsigned);
+};
+
+const Workload Workloads[] = {
+        {"deep", generateDeep},
+        {"wide", generateWide},
+        {"args", generateArgs},
+        {"lines", generateLines},
+};
+
+struct Metric {
+    std::string Name;
+    double Value;
+    const char *Unit;
+    bool HigherIsBetter;
+};
+
+std::vector<Metric> Results;
+
+void record(std::string Name, double Value, const char *Unit, bool HigherIsBetter) {
+    Results.push_back({std::move(Name), Value, Unit, HigherIsBetter});
+}
+
+double getPhaseSeconds(const llvm::json::Object &File, llvm::StringRef Phase) {
+    if (auto *Phases = File.getObject("phases"))
+        if (auto *Time = Phases->getObject(Phase))
+            return Time->getNumber("wall_seconds").getValueOr(0);
+    return 0;
+}
+
+// Compiles one workload with toyc and records its metrics.
+bool runCompileBenchmark(const Workload &W) {
+    llvm::SmallString<128> Source, Object, Stats;
+    int FD;
+    if (llvm::sys::fs::createTemporaryFile("toyc-bench", "toy", FD, Source) ||
+        llvm::sys::fs::createTemporaryFile("toyc-bench", "o", Object) ||
+        llvm::sys::fs::createTemporaryFile("toyc-bench", "json", Stats)) {
+        std::fprintf(stderr, "error: cannot create temporary files\n");
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        W.Generate(OS, Scale);
+    }
+
+    uint64_t Bytes = 0;
+    llvm::sys::fs::file_size(Source, Bytes);
+
+    std::string StatsArg = ("--stats-json-file=" + Stats).str();
+    llvm::StringRef Args[] = {Toyc, "-O2", StatsArg, "-o", Object, Source};
+    llvm::Optional<llvm::StringRef> Redirects[] = {llvm::None, llvm::StringRef(""), llvm::None};
+
+    auto Start = Clock::now();
+    std::string Error;
+    int Status = llvm::sys::ExecuteAndWait(Toyc, Args, llvm::None, Redirects, 0, 0, &Error);
+    double Seconds = elapsedSeconds(Start);
+
+    auto Buffer = llvm::MemoryBuffer::getFile(Stats);
+    llvm::sys::fs::remove(Source);
+    llvm::sys::fs::remove(Object);
+    llvm::sys::fs::remove(Stats);
+    if (Status != 0 || !Buffer) {
+        std::fprintf(stderr, "error: %s failed on workload '%s' %s\n", Toyc.c_str(), W.Name, Error.c_str());
+        return false;
+    }
+
+    auto Report = llvm::json::parse((*Buffer)->getBuffer());
+    if (!Report) {
+        llvm::consumeError(Report.takeError());
+        std::fprintf(stderr, "error: unreadable statistics for workload '%s'\n", W.Name);
+        return false;
+    }
+    const llvm::json::Object *Root = Report->getAsObject();
+    const llvm::json::Array *Files = Root ? Root->getArray("files") : nullptr;
+    const llvm::json::Object *File = Files && !Files->empty() ? (*Files)[0].getAsObject() : nullptr;
+    if (!File) {
+        std::fprintf(stderr, "error: no statistics for workload '%s'\n", W.Name);
+        return false;
+    }
+
+    auto Rate = [](double Count, double Seconds) { return Seconds > 0 ? Count / Seconds : 0; };
+    std::string Prefix = std::string(W.Name) + ".";
+    record(Prefix + "lex", Rate(Bytes / 1e6, getPhaseSeconds(*File, "lex")), "MB/s", true);
+    record(Prefix + "parse", Rate(File->getInteger("ast_nodes").getValueOr(0), getPhaseSeconds(*File, "parse")),
+           "nodes/s", true);
+    record(Prefix + "codegen", Rate(File->getInteger("functions").getValueOr(0), getPhaseSeconds(*File, "codegen")),
+           "functions/s", true);
+    record(Prefix + "compile", Seconds, "s", false);
+    record(Prefix + "peak_rss", Root->getInteger("peak_rss_bytes").getValueOr(0) / (1024.0 * 1024.0), "MiB", false);
+    return true;
+}
+
+// Keeps the optimizer from discarding the reference loops.
+volatile double Sink;
+
+// Runs Kernel over N elements until about a quarter second has passed and
+// returns millions of elements per second.
+template <typename KernelFn>
+double measureThroughput(size_t N, KernelFn Kernel) {
+    unsigned Reps = 0;
+    auto Start = Clock::now();
+    double Seconds;
+    do {
+        Kernel();
+        ++Reps;
+    } while ((Seconds = elapsedSeconds(Start)) < 0.25);
+    return Reps * (double)N / Seconds / 1e6;
+}
+
+void runRuntimeBenchmarks() {
+    const size_t N = 1 << 16; // stays in cache, so the loops are compute bound
+    std::vector<int32_t> X32(N), Y32(N), Out32(N);
+    std::vector<double> A(N), B(N), OutF(N);
+    std::vector<int64_t> X64(N), Lo(N, -500), Hi(N, 500), Out64(N);
+    for (size_t I = 0; I != N; ++I) {
+        X32[I] = (int32_t)I;
+        Y32[I] = (int32_t)(N - I);
+        A[I] = 1.0 + I * 0.001;
+        B[I] = (I % 100) * 0.01;
+        X64[I] = (int64_t)(I % 2000) - 1000;
+    }
+
+    auto Compare = [](const char *Name, double Toy, double Cxx) {
+        record(std::string("runtime.") + Name, Toy, "Melem/s", true);
+        record(std::string("runtime.") + Name + ".c++", Cxx, "Melem/s", true);
+    };
+
+    Compare("average",
+            measureThroughput(N, [&] { average_batch(X32.data(), Y32.data(), Out32.data(), N); }),
+            measureThroughput(N, [&] {
+                for (size_t I = 0; I != N; ++I)
+                    Out32[I] = (X32[I] + Y32[I]) * 5;
+                Sink = Out32[N / 2];
+            }));
+    Compare("discount",
+            measureThroughput(N, [&] { discount_batch(A.data(), B.data(), OutF.data(), N); }),
+            measureThroughput(N, [&] {
+                for (size_t I = 0; I != N; ++I)
+                    OutF[I] = A[I] * (1 - B[I]);
+                Sink = OutF[N / 2];
+            }));
+    Compare("horner",
+            measureThroughput(N, [&] { horner_batch(A.data(), OutF.data(), N); }),
+            measureThroughput(N, [&] {
+                for (size_t I = 0; I != N; ++I)
+                    OutF[I] = ((A[I] * 3 + 2) * A[I] - 7) * A[I] + 1;
+                Sink = OutF[N / 2];
+            }));
+    Compare("clamp",
+            measureThroughput(N, [&] { clamp_batch(X64.data(), Lo.data(), Hi.data(), Out64.data(), N); }),
+            measureThroughput(N, [&] {
+                for (size_t I = 0; I != N; ++I)
+                    Out64[I] = X64[I] < Lo[I] ? Lo[I] : Hi[I] < X64[I] ? Hi[I] : X64[I];
+                Sink = Out64[N / 2];
+            }));
+}
+
+bool writeResults(llvm::StringRef Filename) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Filename, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        std::fprintf(stderr, "error: cannot open '%s': %s\n", Filename.str().c_str(), EC.message().c_str());
+        return false;
+    }
+    llvm::json::Object Values;
+    for (const Metric &M : Results)
+        Values[M.Name] = M.Value;
+    OS << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+            {"version", 1}, {"scale", (int64_t)Scale}, {"results", std::move(Values)}})) << "\n";
+    return true;
+}
+
+// Prints every result, with its change against the baseline when there is
+// one. Returns false if anything regressed beyond the tolerance.
+bool reportResults() {
+    llvm::json::Object BaselineValues;
+    if (!Baseline.empty()) {
+        auto Buffer = llvm::MemoryBuffer::getFile(Baseline);
+        auto Parsed = Buffer ? llvm::json::parse((*Buffer)->getBuffer())
+                             : llvm::Expected<llvm::json::Value>(llvm::errorCodeToError(Buffer.getError()));
+        const llvm::json::Object *Values = nullptr;
+        if (Parsed && Parsed->getAsObject())
+            Values = Parsed->getAsObject()->getObject("results");
+        if (!Parsed)
+            llvm::consumeError(Parsed.takeError());
+        if (!Values) {
+            std::fprintf(stderr, "error: cannot read baseline '%s'\n", Baseline.c_str());
+            return false;
+        }
+        BaselineValues = *Values;
+    }
+
+    bool Regressed = false;
+    std::printf("%-28s %14s %-12s %10s\n", "benchmark", "value", "unit", "change");
+    for (const Metric &M : Results) {
+        std::printf("%-28s %14.2f %-12s", M.Name.c_str(), M.Value, M.Unit);
+        llvm::Optional<double> Base = BaselineValues.getNumber(M.Name);
+        if (Base && *Base > 0) {
+            double Change = (M.Value - *Base) / *Base * 100;
+            bool Worse = M.HigherIsBetter ? -Change > Tolerance : Change > Tolerance;
+            std::printf(" %+9.1f%%%s", Change, Worse ? "  REGRESSION" : "");
+            Regressed |= Worse;
+        }
+        std::printf("\n");
+    }
+    return !Regressed;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "ToyC benchmarks\n");
+
+    if (!Generate.empty()) {
+        for (const Workload &W : Workloads) {
+            if (Generate == W.Name) {
+                W.Generate(llvm::outs(), Scale);
+                return 0;
+            }
+        }
+        std::fprintf(stderr, "error: unknown workload '%s'\n", Generate.c_str());
+        return 1;
+    }
+
+    for (const Workload &W : Workloads)
+        if (!runCompileBenchmark(W))
+            return 1;
+    runRuntimeBenchmarks();
+
+    if (!JSONOutput.empty() && !writeResults(JSONOutput))
+        return 1;
+    return reportResults() ? 0 : 1;
+}
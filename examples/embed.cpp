@@ -0,0 +1,39 @@
+#include "toyc/Compiler.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+// -----------------------------------------------------------------------------
+// ToyC Embedding Example
+// -----------------------------------------------------------------------------
+//
+// Compiles ToyC source in-process and calls it, with no toyc process, object
+// file or link step (compare runner.cpp).
+//
+// 1. Build it: cmake --build build --target toyc-embed-example
+// 2. Run it:   ./toyc-embed-example
+// -----------------------------------------------------------------------------
+
+int main() {
+    // Formulas like these could come from a config file or a request.
+    auto Module = toyc::Compiler::compile("def average(x y) (x + y) * 5\n"
+                                          "def discount(price:f64 rate:f64):f64 price * (1 - rate)\n");
+    if (!Module) {
+        llvm::errs() << llvm::toString(Module.takeError()) << "\n";
+        return 1;
+    }
+
+    auto Average = Module->lookup<int(int, int)>("average");
+    auto Discount = Module->lookup<double(double, double)>("discount");
+    if (!Average || !Discount) {
+        llvm::errs() << llvm::toString(llvm::joinErrors(Average.takeError(), Discount.takeError())) << "\n";
+        return 1;
+    }
+
+    llvm::outs() << "average(10, 20) = " << (*Average)(10, 20) << "\n";
+    llvm::outs() << "discount(80, 0.25) = " << llvm::format("%.2f", (*Discount)(80, 0.25)) << "\n";
+
+    // A lookup with the wrong signature fails instead of calling through it.
+    auto Wrong = Module->lookup<double(double)>("average");
+    llvm::outs() << "lookup<double(double)>(\"average\"): " << llvm::toString(Wrong.takeError()) << "\n";
+    return 0;
+}
@@ -10,6 +10,9 @@
 // 3. Press Ctrl+D to exit. This generates 'output.o'
 // 4. Compile this runner: clang++ examples/runner.cpp output.o -o my_program
 // 5. Run it: ./my_program
+//
+// To let the linker inline 'average' into main, compile with ./toyc -flto=thin
+// and link with: clang++ -flto=thin -fuse-ld=lld examples/runner.cpp output.o
 // -----------------------------------------------------------------------------
 
 // Declare the function signature that exists in our object file.
@@ -0,0 +1,48 @@
+#include <cstdint>
+#include <iostream>
+
+// -----------------------------------------------------------------------------
+// ToyC Typed and SIMD Interop Example
+// -----------------------------------------------------------------------------
+//
+// 1. Compile the example with AVX enabled, so f64x4 values travel in one
+//    256-bit register: ./toyc -mattr=+avx examples/pricing.toy
+// 2. Compile this runner with the same ISA:
+//    clang++ -mavx examples/simd_runner.cpp output.o -o simd_program
+// 3. Run it: ./simd_program
+// -----------------------------------------------------------------------------
+
+// f64x4 is a <4 x double> vector, which the C ABI passes like __m256d.
+typedef double f64x4 __attribute__((vector_size(32)));
+
+extern "C" {
+    double discount(double price, double rate);
+    f64x4 discount4(f64x4 price, f64x4 rate);
+    int64_t total(int64_t units, int64_t cents);
+}
+
+int main() {
+    std::cout << "Running ToyC Typed Interop Test..." << std::endl;
+
+    bool ok = discount(200.0, 0.25) == 150.0;
+
+    f64x4 prices = {100.0, 200.0, 300.0, 400.0};
+    f64x4 rates = {0.5, 0.25, 0.0, 0.75};
+    f64x4 result = discount4(prices, rates);
+    // Expected lanes: 50 150 300 100
+    for (int i = 0; i < 4; ++i) {
+        std::cout << "Lane " << i << ": " << result[i] << std::endl;
+        ok &= result[i] == prices[i] * (1 - rates[i]);
+    }
+
+    // Beyond what an i32 (or a double) can hold exactly.
+    ok &= total(3000000000LL, 3) == 9000000000LL;
+
+    if (ok) {
+        std::cout << "SUCCESS: Integration working." << std::endl;
+    } else {
+        std::cout << "FAILURE: Incorrect result." << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+//
+// Embedding API for the ToyC compiler (the toyc_core library).
+//
+// Compiles ToyC source in memory with the ORC JIT and hands back typed
+// function pointers, with no files, no linking and no toyc process:
+//
+//   auto M = llvm::cantFail(toyc::Compiler::compile("def average(x y) (x + y) * 5"));
+//   auto *Average = llvm::cantFail(M.lookup<int(int, int)>("average"));
+//   int R = Average(10, 20);
+//
+
+#ifndef TOYC_COMPILER_H
+#define TOYC_COMPILER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace toyc {
+
+// Settings for one compilation. The defaults match `toyc --jit`: -O2 for
+// the host CPU and its features.
+struct Options {
+    unsigned OptLevel = 2;             // 0 to 3, as -O
+    std::string CPU;                   // as -mcpu; empty for the host CPU
+    std::vector<std::string> Features; // as -mattr, e.g. "+avx2" or "-fma"
+
+    // Generate each definition when it is first called instead of during
+    // compile, which still parses and type-checks all of them. Helps sources
+    // with many definitions of which a run calls few.
+    bool Lazy = false;
+    // With Lazy, threads that optimize and generate machine code in the
+    // background. Compiling a definition then also queues the definitions it
+    // calls, so they are often ready by the time they are first called.
+    unsigned CompileThreads = 0;
+
+    // Start each definition at -O0 with a call counter, and once it has been
+    // called TierUpCalls times, regenerate it at -O3 for the host CPU on a
+    // background thread. Pointers from lookup switch to the new code. Implies
+    // Lazy; OptLevel is not used.
+    bool Tiered = false;
+    unsigned TierUpCalls = 1000;
+};
+
+// The scalar types of the language, and the C++ types they are passed as.
+enum class ValueType { I32, I64, F32, F64 };
+
+template <typename T> struct ValueTypeOf;
+template <> struct ValueTypeOf<int32_t> { static constexpr ValueType Type = ValueType::I32; };
+template <> struct ValueTypeOf<int64_t> { static constexpr ValueType Type = ValueType::I64; };
+template <> struct ValueTypeOf<float> { static constexpr ValueType Type = ValueType::F32; };
+template <> struct ValueTypeOf<double> { static constexpr ValueType Type = ValueType::F64; };
+
+// The definitions of one compiled source, each generated on its first lookup.
+// Function pointers stay valid for as long as the CompiledModule does, and
+// may be called from any thread.
+class CompiledModule {
+public:
+    CompiledModule(CompiledModule &&);
+    CompiledModule &operator=(CompiledModule &&);
+    ~CompiledModule();
+
+    // The definition Name, checked against the signature Fn, as in
+    // lookup<double(double, double)>("discount").
+    template <typename Fn> llvm::Expected<Fn *> lookup(llvm::StringRef Name) const {
+        return Lookup<Fn>::get(*this, Name);
+    }
+
+    // The address of the definition Name, whatever its signature; functions
+    // with vector parameters or results can only be found this way.
+    llvm::Expected<uint64_t> getAddress(llvm::StringRef Name) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> I;
+
+    explicit CompiledModule(std::unique_ptr<Impl> I);
+    friend class Compiler;
+
+    llvm::Expected<uint64_t> getAddress(llvm::StringRef Name, llvm::ArrayRef<ValueType> Params,
+                                        ValueType Result) const;
+
+    template <typename Fn> struct Lookup;
+    template <typename R, typename... Args> struct Lookup<R(Args...)> {
+        static llvm::Expected<R (*)(Args...)> get(const CompiledModule &M, llvm::StringRef Name) {
+            auto Addr = M.getAddress(Name, {ValueTypeOf<Args>::Type...}, ValueTypeOf<R>::Type);
+            if (!Addr)
+                return Addr.takeError();
+            return reinterpret_cast<R (*)(Args...)>(static_cast<uintptr_t>(*Addr));
+        }
+    };
+};
+
+class Compiler {
+public:
+    // Compiles the definitions and externs in Source, which need not outlive
+    // the call. Externs resolve against the symbols of this process;
+    // top-level expressions are checked but never run. Fails with the
+    // compiler's diagnostics if it reports any. Safe to call from several
+    // threads at once.
+    static llvm::Expected<CompiledModule> compile(llvm::StringRef Source, const Options &Opts = Options());
+};
+
+// The toyc command line, as run by the toyc executable.
+int driverMain(int argc, char **argv);
+
+} // end namespace toyc
+
+#endif // TOYC_COMPILER_H
@@ -0,0 +1,125 @@
+//
+// toyc-client: hands a toyc command line to a resident `toyc --server` and
+// replays what it printed, so a build pays for one socket round trip per file
+// instead of starting toyc and setting up LLVM every time. It links nothing
+// from LLVM. The wire format is described under "Compile Server" in
+// toyc_core.cpp.
+//
+// Usage: toyc-client [--server=<socket>] <toyc options and input files>
+//        The socket defaults to $TOYC_SERVER.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+bool readFull(int FD, void *Buf, size_t Size) {
+    char *Ptr = static_cast<char *>(Buf);
+    while (Size) {
+        ssize_t N = ::read(FD, Ptr, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Ptr += N;
+        Size -= N;
+    }
+    return true;
+}
+
+bool writeFull(int FD, const void *Buf, size_t Size) {
+    const char *Ptr = static_cast<const char *>(Buf);
+    while (Size) {
+        ssize_t N = ::write(FD, Ptr, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Ptr += N;
+        Size -= N;
+    }
+    return true;
+}
+
+bool readString(int FD, std::string &Str) {
+    uint32_t Size;
+    if (!readFull(FD, &Size, sizeof(Size)))
+        return false;
+    Str.resize(Size);
+    return readFull(FD, &Str[0], Size);
+}
+
+bool writeString(int FD, const std::string &Str) {
+    uint32_t Size = Str.size();
+    return writeFull(FD, &Size, sizeof(Size)) && writeFull(FD, Str.data(), Size);
+}
+
+std::string getWorkingDirectory() {
+    std::vector<char> Buf(256);
+    while (!::getcwd(Buf.data(), Buf.size())) {
+        if (errno != ERANGE)
+            return std::string();
+        Buf.resize(Buf.size() * 2);
+    }
+    return Buf.data();
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    const char *SocketPath = std::getenv("TOYC_SERVER");
+    int FirstArg = 1;
+    if (argc > 1 && std::strncmp(argv[1], "--server=", 9) == 0) {
+        SocketPath = argv[1] + 9;
+        FirstArg = 2;
+    }
+    if (!SocketPath || !*SocketPath) {
+        std::fprintf(stderr, "%s: no server; pass --server=<socket> or set TOYC_SERVER\n", argv[0]);
+        return 1;
+    }
+
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (std::strlen(SocketPath) >= sizeof(Addr.sun_path)) {
+        std::fprintf(stderr, "%s: socket path '%s' is too long\n", argv[0], SocketPath);
+        return 1;
+    }
+    std::strcpy(Addr.sun_path, SocketPath);
+
+    int Conn = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Conn < 0 || ::connect(Conn, (sockaddr *)&Addr, sizeof(Addr)) != 0) {
+        std::fprintf(stderr, "%s: cannot connect to '%s': %s\n", argv[0], SocketPath, std::strerror(errno));
+        return 1;
+    }
+
+    std::vector<std::string> Request{getWorkingDirectory()};
+    for (int I = FirstArg; I < argc; ++I)
+        Request.push_back(argv[I]);
+
+    uint32_t Count = Request.size();
+    bool Sent = writeFull(Conn, &Count, sizeof(Count));
+    for (const std::string &Str : Request)
+        Sent = Sent && writeString(Conn, Str);
+
+    uint32_t Status;
+    std::string Output, Diagnostics;
+    if (!Sent || !readFull(Conn, &Status, sizeof(Status)) || !readString(Conn, Output) ||
+        !readString(Conn, Diagnostics)) {
+        std::fprintf(stderr, "%s: lost the connection to '%s'\n", argv[0], SocketPath);
+        return 1;
+    }
+    ::close(Conn);
+
+    std::fwrite(Output.data(), 1, Output.size(), stdout);
+    std::fwrite(Diagnostics.data(), 1, Diagnostics.size(), stderr);
+    return Status;
+}
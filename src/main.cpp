@@ -2,582 +2,8 @@
 // Created by Dillon Monkam on 1/3/2026.
 //
 
-#include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/Module.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/Verifier.h"
-#include "llvm/Support/FileSystem.h"
-#include "llvm/Support/Host.h"
-#include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/MC/TargetRegistry.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Target/TargetOptions.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include <iostream>
-#include <memory>
-#include <vector>
-#include <map>
+#include "toyc/Compiler.h"
 
-//===----------------------------------------------------------------------===//
-// Lexer
-//===----------------------------------------------------------------------===//
-
-enum Token {
-    tok_eof = -1,
-    tok_def = -2,
-    tok_extern = -3,
-    tok_indentifier = -4,
-    tok_number = -5,
-};
-
-static std::string identifierStr;
-static double numVal;
-
-static int getok() {
-    static int nextChar = ' ';
-
-    // whitespace
-    while(isspace(nextChar)){
-        nextChar = getchar();
-    }
-
-    // identifiers, def, extern
-    while(isalpha(nextChar)){
-        identifierStr = nextChar;
-        while(isalnum(nextChar = getchar())){
-            identifierStr += nextChar;
-        }
-
-        if (identifierStr == "def") return tok_def;
-        if (identifierStr == "extern") return tok_extern;
-        return tok_indentifier;
-    }
-
-    // numbers
-    if(isdigit(nextChar) || nextChar == '.'){
-        std::string numStr;
-        do{
-            numStr += nextChar;
-            nextChar = getchar();
-        }while(isdigit(nextChar) || nextChar == '.');
-
-        numVal = strtod(numStr.c_str(), 0);
-        return tok_number;
-    }
-
-    // end of file
-    if(nextChar == EOF){
-        return tok_eof;
-    }
-
-    int current = nextChar;
-    nextChar = getchar();
-    return current;
-}
-
-//===----------------------------------------------------------------------===//
-// Abstract Syntax Tree (AST)
-//===----------------------------------------------------------------------===//
-
-namespace {
-
-class ExprAST {
-public:
-    virtual ~ExprAST() = default;
-    virtual llvm::Value *codegen() = 0;
-};
-
-class NumberExprAST : public ExprAST{
-    double Val;
-public:
-    NumberExprAST(double Val) : Val(Val) {}
-    llvm::Value *codegen() override;
-};
-
-class VariableExprAST : public ExprAST {
-    std::string Name;
-public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
-    llvm::Value *codegen() override;
-};
-
-class BinaryExprAST : public ExprAST {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
-public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-    llvm::Value *codegen() override;
-};
-
-class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
-public:
-    CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
-    llvm::Value *codegen() override;
-};
-
-class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
-public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-            : Name(Name), Args(std::move(Args)) {}
-
-    const std::string &getName() const {return Name;}
-    llvm::Function *codegen();
-};
-
-class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
-public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
-    llvm::Function *codegen();
-};
-
-} // end anonymous namespace
-
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
-
-static int CurTok;
-static int getNextToken(){
-    return CurTok = getok();
-}
-
-static std::map<char, int> BinopPrecedence;
-
-static int GetTokPrecedence(){
-    if(!isascii(CurTok))
-        return -1;
-
-    int TokPrec = BinopPrecedence[CurTok];
-    if(TokPrec <= 0)
-        return -1;
-
-    return TokPrec;
-}
-
-std::unique_ptr<ExprAST> LogError(const char *Str){
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-}
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-
-// Forward declarations for parsing functions
-static std::unique_ptr<ExprAST> ParseExpression();
-static std::unique_ptr<ExprAST> ParseNumberExpr();
-static std::unique_ptr<ExprAST> ParseParenExpr();
-static std::unique_ptr<ExprAST> ParseIdentifierExpr();
-static std::unique_ptr<ExprAST> ParsePrimary();
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS);
-static std::unique_ptr<PrototypeAST> ParsePrototype();
-static std::unique_ptr<FunctionAST> ParseDefinition();
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr();
-static std::unique_ptr<PrototypeAST> ParseExtern();
-
-
-static std::unique_ptr<ExprAST> ParseNumberExpr(){
-    auto Result = std::make_unique<NumberExprAST>(numVal);
-    getNextToken();
-    return std::move(Result);
-}
-
-static std::unique_ptr<ExprAST> ParseParenExpr(){
-    getNextToken(); // eat (.
-    auto V = ParseExpression();
-    if(!V)
-        return nullptr;
-
-    if(CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // eat ).
-    return V;
-}
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr(){
-    std::string IdName = identifierStr;
-    getNextToken(); // eat identifier.
-
-    if(CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
-
-    // Call.
-    getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if(CurTok != ')'){
-        while(true){
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if(CurTok == ')')
-                break;
-
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
-    }
-    getNextToken(); // eat ).
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
-
-static std::unique_ptr<ExprAST> ParsePrimary(){
-    switch(CurTok){
-        default:
-            return LogError("unknown token when expecting an expression");
-        case tok_indentifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParseNumberExpr();
-        case '(':
-            return ParseParenExpr();
-    }
-}
-
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS){
-    while (true){
-        int TokPrec = GetTokPrecedence();
-
-        if(TokPrec < ExprPrec)
-            return LHS;
-
-        int BinOp = CurTok;
-        getNextToken();
-
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
-
-        int NextPrec = GetTokPrecedence();
-        if(TokPrec < NextPrec){
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if(!RHS)
-                return nullptr;
-        }
-
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    }
-}
-
-static std::unique_ptr<ExprAST> ParseExpression(){
-    auto LHS = ParsePrimary();
-    if(!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-static std::unique_ptr<PrototypeAST> ParsePrototype(){
-    if (CurTok != tok_indentifier)
-        return LogErrorP("Expected function name in prototype");
-
-    std::string FnName = identifierStr;
-    getNextToken();
-
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
-
-    std::vector<std::string> ArgNames;
-    while(getNextToken() == tok_indentifier)
-        ArgNames.push_back(identifierStr);
-
-    if(CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
-
-    getNextToken(); // eat ')'.
-
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
-}
-
-static std::unique_ptr<FunctionAST> ParseDefinition(){
-    getNextToken(); // eat def.
-    auto Proto = ParsePrototype();
-    if(!Proto)
-        return nullptr;
-
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-
-    return nullptr;
+int main(int argc, char **argv) {
+    return toyc::driverMain(argc, argv);
 }
-
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken(); // eat extern.
-    return ParsePrototype();
-}
-
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr(){
-    if (auto E = ParseExpression()){
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    }
-    return nullptr;
-}
-
-
-//===----------------------------------------------------------------------===//
-// Code Generation
-//===----------------------------------------------------------------------===//
-
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-static std::map<std::string, llvm::Value*> NamedValues;
-
-void InitializeModuleAndPassManager(){
-    TheContext = std::make_unique<llvm::LLVMContext>();
-    TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
-    Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
-
-llvm::Value *LogErrorV(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-llvm::Value *NumberExprAST::codegen() {
-    return llvm::ConstantInt::get(*TheContext, llvm::APInt(32, Val, true));
-}
-
-llvm::Value *VariableExprAST::codegen(){
-    llvm::Value *V = NamedValues[Name];
-    if(!V)
-        return LogErrorV("Unknown variable name");
-    return V;
-}
-
-llvm::Value *BinaryExprAST::codegen() {
-    llvm::Value *L = LHS->codegen();
-    llvm::Value *R = RHS->codegen();
-
-    if(!L || !R)
-        return nullptr;
-
-    switch (Op) {
-        case '+':
-            return Builder->CreateAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateMul(L, R, "multmp");
-        case '<':
-            L = Builder->CreateICmpULT(L, R, "cmptmp");
-            return Builder->CreateZExt(L, llvm::Type::getInt32Ty(*TheContext), "booltmp");
-        default:
-            return LogErrorV("invalid binary operator");
-    }
-}
-
-llvm::Value *CallExprAST::codegen(){
-    llvm::Function *CalleeF = TheModule->getFunction(Callee);
-    if(!CalleeF)
-        return LogErrorV("Unknown function referenced");
-
-    if(CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
-
-    std::vector<llvm::Value *> ArgsV;
-    for(unsigned i = 0, e = Args.size(); i != e; ++i){
-        ArgsV.push_back(Args[i]->codegen());
-        if(!ArgsV.back())
-            return nullptr;
-    }
-
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
-
-llvm::Function *PrototypeAST::codegen(){
-    std::vector<llvm::Type*> Integers(Args.size(), llvm::Type::getInt32Ty(*TheContext));
-    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getInt32Ty(*TheContext), Integers, false);
-    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
-
-    unsigned Idx = 0;
-    for(auto &Arg: F->args())
-        Arg.setName(Args[Idx++]);
-
-    return F;
-}
-
-llvm::Function *FunctionAST::codegen(){
-    llvm::Function *TheFunction = TheModule->getFunction(Proto->getName());
-
-    if(!TheFunction)
-        TheFunction = Proto->codegen();
-
-    if(!TheFunction)
-        return nullptr;
-
-    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
-    NamedValues.clear();
-    for(auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
-
-    if(llvm::Value *RetVal = Body->codegen()){
-        Builder->CreateRet(RetVal);
-        llvm::verifyFunction(*TheFunction);
-        return TheFunction;
-    }
-
-    TheFunction->eraseFromParent();
-    return nullptr;
-}
-
-//===----------------------------------------------------------------------===//
-// Top-Level Parsing and Main Loop
-//===----------------------------------------------------------------------===//
-
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
-
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (auto *FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
-
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read top-level expression:");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-
-            // Remove the anonymous expression.
-            FnIR->eraseFromParent();
-        }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
-
-static void MainLoop(){
-    while (true){
-        fprintf(stderr, "ready> ");
-        switch (CurTok){
-            case tok_eof:
-                return;
-            case ';':
-                getNextToken();
-                break;
-            case tok_def:
-                HandleDefinition();
-                break;
-            case tok_extern:
-                HandleExtern();
-                break;
-            default:
-                HandleTopLevelExpression();
-                break;
-        }
-    }
-}
-
-//===----------------------------------------------------------------------===//
-// Object File Emitter
-//===----------------------------------------------------------------------===//
-
-void InitializeTargets() {
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
-}
-
-void compileToObject(){
-    auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
-
-    std::string Error;
-    auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
-
-    if(!Target){
-        llvm::errs() << Error;
-        return;
-    }
-
-    auto CPU = "generic";
-    auto Features = "";
-
-    llvm::TargetOptions opt;
-    auto RM = llvm::Optional<llvm::Reloc::Model>();
-    auto TargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, *RM);
-
-    TheModule->setDataLayout(TargetMachine->createDataLayout());
-
-    auto Filename = "output.o";
-    std::error_code EC;
-    llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::OF_None);
-
-    if(EC){
-        llvm::errs() << "Could not open file: " << EC.message();
-        return;
-    }
-
-    llvm::legacy::PassManager pass;
-    auto FileType = llvm::CGFT_ObjectFile;
-
-    if(TargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)){
-        llvm::errs() << "TargetMachine can't emit a file of this type";
-        return;
-    }
-
-    pass.run(*TheModule);
-    llvm::outs() << "Wrote " << Filename << "\n";
-}
-
-//===----------------------------------------------------------------------===//
-// Main
-//===----------------------------------------------------------------------===//
-
-int main() {
-    InitializeTargets();
-
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
-
-    fprintf(stderr, "ready> ");
-    getNextToken();
-
-    InitializeModuleAndPassManager();
-
-    MainLoop();
-
-    compileToObject();
-
-    return 0;
-}
\ No newline at end of file
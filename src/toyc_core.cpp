@@ -0,0 +1,5284 @@
+//
+// Created by Dillon Monkam on 1/3/2026.
+//
+
+#include "toyc/Compiler.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <map>
+#ifdef LLVM_ON_UNIX
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define DEBUG_TYPE "toyc"
+
+//===----------------------------------------------------------------------===//
+// Command-line options
+//===----------------------------------------------------------------------===//
+
+// Every option has an explicit cl::init: --server resets them all to their
+// defaults before parsing each request's arguments.
+
+static llvm::cl::list<std::string> InputFilenames(llvm::cl::Positional,
+        llvm::cl::desc("<input files>"));
+
+static llvm::cl::opt<unsigned> Threads("threads",
+        llvm::cl::desc("Number of files compiled in parallel (default: one per core)"),
+        llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> ParseThreads("parse-threads",
+        llvm::cl::desc("Parse each large input on N threads before generating code "
+                       "(default 1; 0 is one per core)"),
+        llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+static llvm::cl::opt<unsigned> CodegenPartitions("j", llvm::cl::Prefix,
+        llvm::cl::desc("Split each module into N partitions that get machine code in parallel, "
+                       "and write them as an archive (.a)"),
+        llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+static llvm::cl::opt<bool> StreamMode("stream",
+        llvm::cl::desc("Optimize and emit definitions in batches while parsing continues, "
+                       "and write the objects as an archive (.a)"), llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> StreamBatch("stream-batch",
+        llvm::cl::desc("Definitions per module with --stream (default 64)"),
+        llvm::cl::value_desc("N"), llvm::cl::init(64));
+
+static llvm::cl::opt<char> OptLevel("O",
+        llvm::cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+        llvm::cl::Prefix, llvm::cl::init('2'));
+
+enum OverflowKind { Overflow_Wrap, Overflow_Undefined };
+
+static llvm::cl::opt<OverflowKind> Overflow("overflow",
+        llvm::cl::desc("What signed integer + - * and << do when the result does not fit"),
+        llvm::cl::init(Overflow_Wrap),
+        llvm::cl::values(clEnumValN(Overflow_Wrap, "wrap", "Wrap around (default)"),
+                         clEnumValN(Overflow_Undefined, "undefined",
+                                    "Never happens; the optimizer may assume so (nsw)")));
+
+static llvm::cl::opt<bool> UseJIT("jit",
+        llvm::cl::desc("Run top-level expressions in an ORC JIT and print their results"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> ServerSocket("server",
+        llvm::cl::desc("Stay resident and serve compile requests from toyc-client on this Unix socket"),
+        llvm::cl::value_desc("socket"), llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> CacheDir("cache-dir",
+        llvm::cl::desc("Reuse per-function bitcode from this directory for unchanged definitions"),
+        llvm::cl::value_desc("directory"), llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> TargetTripleOpt("mtriple",
+        llvm::cl::desc("Override the target triple (default: the host triple)"),
+        llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> MArch("march",
+        llvm::cl::desc("Architecture to generate code for, overriding the triple's (see -version)"),
+        llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> MCPU("mcpu",
+        llvm::cl::desc("Target a specific cpu type (-mcpu=native for the host CPU)"),
+        llvm::cl::value_desc("cpu-name"), llvm::cl::init("generic"));
+
+static llvm::cl::list<std::string> MAttrs("mattr", llvm::cl::CommaSeparated,
+        llvm::cl::desc("Target specific attributes (-mattr=+avx2,-fma)"),
+        llvm::cl::value_desc("a1,+a2,-a3,..."));
+
+static llvm::cl::opt<std::string> OutputFilename("o",
+        llvm::cl::desc("Output file (default: output.o, or output.bc/.ll/.s for the other modes)"),
+        llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+static llvm::cl::opt<bool> EmitLLVM("emit-llvm",
+        llvm::cl::desc("Write LLVM bitcode (.bc), or textual IR (.ll) with -S, instead of an object file"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<bool> EmitAssembly("S",
+        llvm::cl::desc("Write assembly (.s), or textual IR with --emit-llvm, instead of an object file"),
+        llvm::cl::init(false));
+
+enum LTOKind { LTO_None, LTO_Full, LTO_Thin };
+
+static llvm::cl::opt<LTOKind> LTOMode("flto", llvm::cl::ValueOptional,
+        llvm::cl::desc("Write bitcode for link-time optimization instead of machine code"),
+        llvm::cl::init(LTO_None),
+        llvm::cl::values(clEnumValN(LTO_Full, "", ""),
+                         clEnumValN(LTO_Full, "full", "Monolithic LTO"),
+                         clEnumValN(LTO_Thin, "thin", "ThinLTO, with a per-module summary")));
+
+static llvm::cl::opt<std::string> ProfileGenerate("fprofile-generate", llvm::cl::ValueOptional,
+        llvm::cl::desc("Instrument the code to write <dir>/default_%m.profraw when it runs "
+                       "(link with clang -fprofile-generate, merge with llvm-profdata)"),
+        llvm::cl::value_desc("dir"), llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> ProfileUse("fprofile-use",
+        llvm::cl::desc("Optimize with the execution profile in <file> (a .profdata file, or a "
+                       "directory holding default.profdata)"),
+        llvm::cl::value_desc("file"), llvm::cl::init(""));
+
+static llvm::cl::alias EmitAsmAlias("emit-asm", llvm::cl::desc("Alias for -S"),
+        llvm::cl::aliasopt(EmitAssembly));
+
+static llvm::cl::list<std::string> BatchFunctions("batch", llvm::cl::CommaSeparated,
+        llvm::cl::desc("Also emit <name>_batch(in..., out, n), which maps the function over arrays"),
+        llvm::cl::value_desc("name,..."));
+
+static llvm::cl::list<std::string> ExportFunctions("export", llvm::cl::CommaSeparated,
+        llvm::cl::desc("Keep only these functions (and their --batch entry points) visible outside "
+                       "the object; the rest become internal and may be inlined away"),
+        llvm::cl::value_desc("name,..."));
+
+static llvm::cl::opt<bool> PrintIR("print-ir",
+        llvm::cl::desc("Print the IR of every definition, extern and expression as it is read"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<bool> ReportTailCalls("report-tail-calls",
+        llvm::cl::desc("Report recursive calls that were not turned into loops, and why"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<bool> TimeReport("time-report",
+        llvm::cl::desc("Print per-phase timings and compilation statistics to stderr"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> StatsJSON("stats-json-file",
+        llvm::cl::desc("Write per-phase timings and compilation statistics as JSON"),
+        llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+//===----------------------------------------------------------------------===//
+// Statistics and Timing
+//===----------------------------------------------------------------------===//
+
+// Process-wide totals, summed over every file once it has been compiled.
+ALWAYS_ENABLED_STATISTIC(NumTokens, "Number of tokens lexed");
+ALWAYS_ENABLED_STATISTIC(NumASTNodes, "Number of AST nodes created");
+ALWAYS_ENABLED_STATISTIC(NumFunctions, "Number of functions generated");
+ALWAYS_ENABLED_STATISTIC(NumIRInstructions, "Number of IR instructions after optimization");
+ALWAYS_ENABLED_STATISTIC(NumLazyDefinitions, "Number of definitions generated on demand by the lazy JIT");
+ALWAYS_ENABLED_STATISTIC(NumSpeculatedDefinitions, "Number of callees queued for background compilation");
+ALWAYS_ENABLED_STATISTIC(NumTierUps, "Number of hot definitions recompiled at -O3 by the tiered JIT");
+
+namespace {
+
+// Phase timers and counters for one compilation. Lex times a separate
+// lex-only pass over the buffer, because the parser pulls tokens on demand
+// and that lexing is part of Parse. The other phases follow one another,
+// except that with --stream the emitter thread's ModuleOpt and Emit run
+// while parsing and IR generation go on, so the phase times can add up to
+// more than the compilation took.
+class CompileStats {
+public:
+    std::string File;
+    llvm::TimerGroup Group;
+    llvm::Timer Lex, Parse, Simplify, Codegen, Verify, FunctionOpt, Cache, ModuleOpt, Emit;
+
+    uint64_t Tokens = 0;
+    uint64_t ASTNodes = 0;
+    uint64_t Functions = 0;
+    uint64_t IRInstructions = 0;
+    bool Overlapped = false; // Set with --stream.
+
+    explicit CompileStats(llvm::StringRef File)
+            : File(File), Group("toyc", "ToyC compilation of '" + File.str() + "'"),
+              Lex("lex", "Lexing", Group), Parse("parse", "Parsing", Group),
+              Simplify("simplify", "AST simplification", Group),
+              Codegen("codegen", "IR generation", Group), Verify("verify", "IR verification", Group),
+              FunctionOpt("function-opt", "Per-function optimization", Group),
+              Cache("cache", "Function cache", Group), ModuleOpt("module-opt", "Module optimization", Group),
+              Emit("emit", "Machine code emission", Group) {}
+
+    // Returns the timer for Phase, or null (which TimeRegion ignores) when
+    // statistics are off.
+    static llvm::Timer *get(CompileStats *S, llvm::Timer CompileStats::*Phase) {
+        return S ? &(S->*Phase) : nullptr;
+    }
+
+    double getTokensPerSecond() const;
+    llvm::json::Value toJSON() const;
+    // Prints the report and resets the timers, so it must come after toJSON().
+    void print(llvm::raw_ostream &OS);
+};
+
+} // end anonymous namespace
+
+static llvm::Timer CompileStats::*const AllPhases[] = {
+        &CompileStats::Lex, &CompileStats::Parse, &CompileStats::Simplify, &CompileStats::Codegen, &CompileStats::Verify,
+        &CompileStats::FunctionOpt, &CompileStats::Cache, &CompileStats::ModuleOpt, &CompileStats::Emit};
+
+double CompileStats::getTokensPerSecond() const {
+    // Interactive input has no lex-only pass; fall back to the parse time.
+    double Seconds = Lex.getTotalTime().getWallTime();
+    if (Seconds == 0)
+        Seconds = Parse.getTotalTime().getWallTime();
+    return Seconds > 0 ? Tokens / Seconds : 0;
+}
+
+llvm::json::Value CompileStats::toJSON() const {
+    llvm::json::Object Phases;
+    for (auto Phase : AllPhases) {
+        const llvm::Timer &T = this->*Phase;
+        llvm::TimeRecord Time = T.getTotalTime();
+        Phases[T.getName()] = llvm::json::Object{
+                {"wall_seconds", Time.getWallTime()},
+                {"user_seconds", Time.getUserTime()},
+                {"system_seconds", Time.getSystemTime()}};
+    }
+
+    return llvm::json::Object{
+            {"file", File},
+            {"phases", std::move(Phases)},
+            {"tokens", (int64_t)Tokens},
+            {"tokens_per_second", getTokensPerSecond()},
+            {"ast_nodes", (int64_t)ASTNodes},
+            {"functions", (int64_t)Functions},
+            {"ir_instructions", (int64_t)IRInstructions},
+            {"overlapping_phases", Overlapped}};
+}
+
+void CompileStats::print(llvm::raw_ostream &OS) {
+    double TokensPerSecond = getTokensPerSecond();
+    Group.print(OS, /*ResetAfterPrint=*/true);
+    OS << "  Tokens: " << Tokens << " (" << llvm::format("%.0f", TokensPerSecond) << " tokens/sec)\n"
+       << "  AST nodes: " << ASTNodes << "\n"
+       << "  Functions: " << Functions << "\n"
+       << "  IR instructions: " << IRInstructions << "\n";
+    if (Overlapped)
+        OS << "  Module optimization and emission ran in the background during the\n"
+              "  other phases (--stream), so the times above overlap.\n";
+    OS << "\n";
+}
+
+// Per-file records for --stats-json-file, appended by whichever thread finishes.
+static std::mutex FileStatsLock;
+static std::vector<llvm::json::Value> FileStats;
+
+static uint64_t getPeakRSSBytes() {
+#ifdef LLVM_ON_UNIX
+    struct rusage Usage;
+    if (getrusage(RUSAGE_SELF, &Usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return Usage.ru_maxrss; // bytes on Darwin
+#else
+    return (uint64_t)Usage.ru_maxrss * 1024; // kilobytes elsewhere
+#endif
+#else
+    return 0;
+#endif
+}
+
+static bool writeStatsJSON(llvm::StringRef Filename, llvm::raw_ostream &Errs) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Filename, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        Errs << "Error: could not open '" << Filename << "': " << EC.message() << "\n";
+        return false;
+    }
+
+    llvm::json::Object Totals;
+    for (auto &Stat : llvm::GetStatistics())
+        Totals[Stat.first] = (int64_t)Stat.second;
+
+    OS << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+            {"version", 1},
+            {"peak_rss_bytes", (int64_t)getPeakRSSBytes()},
+            {"totals", std::move(Totals)},
+            {"files", llvm::json::Array(FileStats)}})) << "\n";
+    return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+enum Token {
+    tok_eof = -1,
+    tok_def = -2,
+    tok_extern = -3,
+    tok_indentifier = -4,
+    tok_number = -5,
+
+    // control
+    tok_for = -6,
+    tok_in = -7,
+    tok_if = -8,
+    tok_then = -9,
+    tok_else = -10,
+};
+
+// Operators spelled with two characters are returned as a letter, which is
+// never a token of its own because letters always start an identifier.
+enum OperatorCode : char {
+    op_shl = 'l', // <<
+    op_shr = 'r', // >>
+};
+
+namespace {
+
+// The lexer scans [CurPtr, BufferEnd). Files and piped input are read in one
+// go; an interactive stdin is read a line at a time and every line is kept.
+// Identifiers and numeric literals are slices of that text, so they stay valid
+// for the lifetime of the Lexer.
+class Lexer {
+    std::unique_ptr<llvm::MemoryBuffer> SourceBuffer;
+    const char *CurPtr = "";
+    const char *BufferEnd = CurPtr;
+    bool InteractiveInput = false;
+    llvm::BumpPtrAllocator LineAllocator;
+    llvm::StringSaver SavedLines{LineAllocator};
+
+    llvm::StringRef identifierStr;
+    llvm::StringRef numStr;
+    double numVal = 0;
+    uint64_t TokenCount = 0;
+
+    bool RefillBuffer();
+    int lexToken();
+public:
+    bool OpenSource(llvm::StringRef Filename, llvm::raw_ostream &Errs);
+    void OpenInteractiveSource() { InteractiveInput = true; }
+    // Lexes Text in place; it must outlive the Lexer.
+    void OpenBuffer(llvm::StringRef Text) {
+        CurPtr = Text.begin();
+        BufferEnd = Text.end();
+    }
+    bool isInteractive() const { return InteractiveInput; }
+    // The whole input, or an empty string for interactive input.
+    llvm::StringRef getBuffer() const {
+        return SourceBuffer ? SourceBuffer->getBuffer() : llvm::StringRef();
+    }
+
+    int getok() {
+        int Tok = lexToken();
+        if (Tok != tok_eof)
+            ++TokenCount;
+        return Tok;
+    }
+    uint64_t getTokenCount() const { return TokenCount; }
+    llvm::StringRef getIdentifier() const { return identifierStr; }
+    llvm::StringRef getNumStr() const { return numStr; }
+    double getNumVal() const { return numVal; }
+};
+
+} // end anonymous namespace
+
+bool Lexer::OpenSource(llvm::StringRef Filename, llvm::raw_ostream &Errs){
+    auto BufOrErr = Filename == "-"
+            ? llvm::MemoryBuffer::getSTDIN()
+            : llvm::MemoryBuffer::getFile(Filename, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!BufOrErr) {
+        Errs << "Error: could not open '" << Filename << "': " << BufOrErr.getError().message() << "\n";
+        return false;
+    }
+
+    SourceBuffer = std::move(*BufOrErr);
+    CurPtr = SourceBuffer->getBufferStart();
+    BufferEnd = SourceBuffer->getBufferEnd();
+    return true;
+}
+
+// Reads the next line of interactive input. Returns false at end of input.
+bool Lexer::RefillBuffer(){
+    if (!InteractiveInput)
+        return false;
+
+    std::string Line;
+    int C;
+    while ((C = getchar()) != EOF) {
+        Line += (char)C;
+        if (C == '\n')
+            break;
+    }
+    if (Line.empty())
+        return false;
+
+    llvm::StringRef Saved = SavedLines.save(Line);
+    CurPtr = Saved.begin();
+    BufferEnd = Saved.end();
+    return true;
+}
+
+int Lexer::lexToken() {
+    // whitespace
+    while (true) {
+        if (CurPtr == BufferEnd && !RefillBuffer())
+            return tok_eof;
+        if (!isspace((unsigned char)*CurPtr))
+            break;
+        ++CurPtr;
+    }
+
+    // Tokens never span a line, so everything below stays inside the buffer.
+    const char *TokStart = CurPtr;
+
+    // identifiers, def, extern
+    if(isalpha((unsigned char)*CurPtr)){
+        while(CurPtr != BufferEnd && isalnum((unsigned char)*CurPtr))
+            ++CurPtr;
+        identifierStr = llvm::StringRef(TokStart, CurPtr - TokStart);
+
+        if (identifierStr == "def") return tok_def;
+        if (identifierStr == "extern") return tok_extern;
+        if (identifierStr == "for") return tok_for;
+        if (identifierStr == "in") return tok_in;
+        if (identifierStr == "if") return tok_if;
+        if (identifierStr == "then") return tok_then;
+        if (identifierStr == "else") return tok_else;
+        return tok_indentifier;
+    }
+
+    // numbers
+    if(isdigit((unsigned char)*CurPtr) || *CurPtr == '.'){
+        do{
+            ++CurPtr;
+        }while(CurPtr != BufferEnd && (isdigit((unsigned char)*CurPtr) || *CurPtr == '.'));
+        numStr = llvm::StringRef(TokStart, CurPtr - TokStart);
+
+        llvm::SmallString<32> NumBuf(numStr);
+        numVal = strtod(NumBuf.c_str(), 0);
+        return tok_number;
+    }
+
+    if (CurPtr + 1 != BufferEnd && (*CurPtr == '<' || *CurPtr == '>') && CurPtr[1] == *CurPtr) {
+        CurPtr += 2;
+        return *TokStart == '<' ? op_shl : op_shr;
+    }
+
+    return (unsigned char)*CurPtr++;
+}
+
+//===----------------------------------------------------------------------===//
+// Abstract Syntax Tree (AST)
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+class CodeGenContext;
+
+// The type of a value: a scalar, or a fixed-width vector of one (f64x4).
+// IntLiteral and FloatLiteral only exist during type checking: they mark
+// expressions built from literals alone, which take on whatever type their
+// context needs and otherwise default to i32 or f64.
+struct ToyType {
+    enum Kind : uint8_t { I32, I64, F32, F64, IntLiteral, FloatLiteral };
+
+    Kind K = IntLiteral;
+    uint8_t Lanes = 1; // 1 for scalars
+
+    ToyType() = default;
+    ToyType(Kind K, unsigned Lanes = 1) : K(K), Lanes(Lanes) {}
+
+    bool isLiteral() const { return K == IntLiteral || K == FloatLiteral; }
+    bool isFloat() const { return K == F32 || K == F64 || K == FloatLiteral; }
+    bool isVector() const { return Lanes > 1; }
+
+    // The type an unconstrained literal expression ends up with.
+    ToyType getDefault() const {
+        if (K == IntLiteral)
+            return ToyType(I32, Lanes);
+        if (K == FloatLiteral)
+            return ToyType(F64, Lanes);
+        return *this;
+    }
+
+    bool operator==(const ToyType &RHS) const { return K == RHS.K && Lanes == RHS.Lanes; }
+    bool operator!=(const ToyType &RHS) const { return !(*this == RHS); }
+
+    llvm::Type *getLLVMType(llvm::LLVMContext &C) const;
+    std::string str() const;
+
+    // Parses i32, i64, f32, f64, or one of those followed by xN for N lanes.
+    static llvm::Optional<ToyType> parse(llvm::StringRef Name);
+};
+
+// A numeric literal as written. Integer literals keep their exact value so
+// that i64 constants beyond 2^53 are not rounded through a double.
+struct NumericLiteral {
+    double FPVal;
+    int64_t IntVal;
+    bool IsFloat; // written with a '.'
+};
+
+// Nodes live in an ASTContext arena and are never destroyed one by one, so
+// they must not own anything: children are plain pointers, names are interned
+// StringRefs and argument lists are arena-backed ArrayRefs.
+class ExprAST {
+public:
+    enum ExprKind { EK_Number, EK_Variable, EK_Binary, EK_Call, EK_For, EK_If };
+private:
+    const ExprKind Kind;
+    ToyType Ty; // Assigned by the TypeChecker.
+    bool Shared = false; // Set by the ASTSimplifier on nodes with several users.
+public:
+    ExprAST(ExprKind Kind) : Kind(Kind) {}
+    ExprKind getKind() const { return Kind; }
+    ToyType getType() const { return Ty; }
+    void setType(ToyType T) { Ty = T; }
+    bool isShared() const { return Shared; }
+    void setShared() { Shared = true; }
+    virtual llvm::Value *codegen(CodeGenContext &Ctx) = 0;
+};
+
+class NumberExprAST : public ExprAST{
+    NumericLiteral Val;
+public:
+    NumberExprAST(NumericLiteral Val) : ExprAST(EK_Number), Val(Val) {}
+    const NumericLiteral &getVal() const { return Val; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+};
+
+// Variables are resolved by the parser to a slot in the enclosing function, so
+// codegen never looks names up. Unknown names keep UnresolvedSlot and are
+// reported when codegen reaches them.
+class VariableExprAST : public ExprAST {
+    llvm::StringRef Name;
+    unsigned Slot;
+public:
+    static constexpr unsigned UnresolvedSlot = ~0u;
+
+    VariableExprAST(llvm::StringRef Name, unsigned Slot) : ExprAST(EK_Variable), Name(Name), Slot(Slot) {}
+    llvm::StringRef getName() const { return Name; }
+    unsigned getSlot() const { return Slot; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+};
+
+class BinaryExprAST : public ExprAST {
+    char Op;
+    ExprAST *LHS, *RHS;
+public:
+    BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+};
+
+// Functions the compiler provides itself, as LLVM intrinsics, when no
+// definition or extern of that name is in scope. They have no side effects.
+enum BuiltinKind : uint8_t { BI_None, BI_Min, BI_Max, BI_Abs, BI_Sqrt, BI_FMA };
+
+class CallExprAST : public ExprAST {
+    llvm::StringRef Callee;
+    llvm::ArrayRef<ExprAST *> Args;
+    BuiltinKind Builtin = BI_None; // Assigned by the TypeChecker.
+public:
+    CallExprAST(llvm::StringRef Callee, llvm::ArrayRef<ExprAST *> Args, BuiltinKind Builtin = BI_None)
+            : ExprAST(EK_Call), Callee(Callee), Args(Args), Builtin(Builtin) {}
+    llvm::StringRef getCallee() const { return Callee; }
+    llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
+    BuiltinKind getBuiltin() const { return Builtin; }
+    void setBuiltin(BuiltinKind B) { Builtin = B; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+// for Var = Start, End, Step in Body. Var gets a slot of its own. Like a C
+// for loop, End is tested before every iteration, including the first; the
+// loop itself evaluates to 0.
+class ForExprAST : public ExprAST {
+    llvm::StringRef VarName;
+    unsigned Slot;
+    ExprAST *Start, *End, *Step, *Body; // Step is null for the default of 1.
+public:
+    ForExprAST(llvm::StringRef VarName, unsigned Slot, ExprAST *Start, ExprAST *End, ExprAST *Step,
+               ExprAST *Body)
+            : ExprAST(EK_For), VarName(VarName), Slot(Slot), Start(Start), End(End), Step(Step), Body(Body) {}
+    llvm::StringRef getVarName() const { return VarName; }
+    unsigned getSlot() const { return Slot; }
+    ExprAST *getStart() const { return Start; }
+    ExprAST *getEnd() const { return End; }
+    ExprAST *getStep() const { return Step; }
+    ExprAST *getBody() const { return Body; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+// if Cond then Then else Else, where any non-zero Cond selects Then.
+class IfExprAST : public ExprAST {
+    ExprAST *Cond, *Then, *Else;
+public:
+    IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+    ExprAST *getCond() const { return Cond; }
+    ExprAST *getThen() const { return Then; }
+    ExprAST *getElse() const { return Else; }
+    llvm::Value *codegen(CodeGenContext &Ctx) override;
+    // Generates the if in tail position, returning from each arm.
+    bool emitReturn(CodeGenContext &Ctx);
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+};
+
+// Unannotated parameters and results are i32. A literal return type means
+// "infer from the body"; it is only used for top-level expressions.
+class PrototypeAST {
+    llvm::StringRef Name;
+    llvm::ArrayRef<llvm::StringRef> Args;
+    llvm::ArrayRef<ToyType> ArgTypes;
+    ToyType RetType;
+public:
+    PrototypeAST(llvm::StringRef Name, llvm::ArrayRef<llvm::StringRef> Args,
+                 llvm::ArrayRef<ToyType> ArgTypes, ToyType RetType)
+            : Name(Name), Args(Args), ArgTypes(ArgTypes), RetType(RetType) {}
+
+    llvm::StringRef getName() const {return Name;}
+    llvm::ArrayRef<llvm::StringRef> getArgs() const {return Args;}
+    llvm::ArrayRef<ToyType> getArgTypes() const {return ArgTypes;}
+    ToyType getRetType() const {return RetType;}
+    void setRetType(ToyType T) {RetType = T;}
+    llvm::FunctionType *getFunctionType(llvm::LLVMContext &C) const;
+    llvm::Function *codegen(CodeGenContext &Ctx);
+};
+
+class FunctionAST {
+    PrototypeAST *Proto;
+    ExprAST *Body;
+    unsigned NumSlots; // Parameters come first, in order.
+public:
+    FunctionAST(PrototypeAST *Proto, ExprAST *Body, unsigned NumSlots)
+            : Proto(Proto), Body(Body), NumSlots(NumSlots) {}
+    PrototypeAST *getProto() const { return Proto; }
+    ExprAST *getBody() const { return Body; }
+    unsigned getNumSlots() const { return NumSlots; }
+    llvm::Function *codegen(CodeGenContext &Ctx);
+};
+
+// Compact, pointer-free encoding of one expression tree. Nodes sit in parallel
+// arrays indexed by 32-bit IDs and are stored in post-order, so every operand
+// precedes its user: building and codegen are flat loops rather than
+// recursion, and chains millions of nodes deep need no extra stack. Ifs and
+// loops are leaves that generate their own blocks, flattening their operands
+// in turn, so only nesting of those constructs costs stack.
+class FlatExpr {
+public:
+    using NodeID = uint32_t;
+    enum Opcode : uint8_t { Number, Variable, Binary, Call, Nested };
+
+    // Per-node operands; their meaning depends on the opcode:
+    //   Number:   A = index into Constants and ConstantTypes
+    //   Variable: A = slot
+    //   Binary:   A = LHS node, B = RHS node, C = operator character
+    //   Call:     A = index into Names and Builtins (callee), B = first index
+    //             into CallArgs, C = argument count
+    //   Nested:   A = index into NestedExprs (an if or for)
+    std::vector<Opcode> Opcodes;
+    std::vector<uint32_t> A, B, C;
+
+    std::vector<NumericLiteral> Constants;
+    std::vector<ToyType> ConstantTypes;
+    std::vector<llvm::StringRef> Names;
+    std::vector<BuiltinKind> Builtins;
+    std::vector<NodeID> CallArgs;
+    std::vector<ExprAST *> NestedExprs;
+
+    // Flattens Root, down to but not into its ifs and loops.
+    void build(ExprAST *Root);
+    llvm::Value *codegen(CodeGenContext &Ctx) const;
+
+    size_t size() const { return Opcodes.size(); }
+
+private:
+    NodeID addNode(Opcode Op, uint32_t OpA, uint32_t OpB = 0, uint32_t OpC = 0);
+};
+
+// Owns every AST node and identifier of a translation unit. Everything is
+// bump-allocated. Prototypes and identifiers are released in one go when the
+// context is destroyed; function bodies, which are dead once their IR
+// exists, live in a second arena that is reset after every top-level item.
+class ASTContext {
+    llvm::BumpPtrAllocator Allocator;
+    llvm::BumpPtrAllocator BodyAllocator;
+    llvm::UniqueStringSaver Identifiers{Allocator};
+    uint64_t NodeCount = 0;
+public:
+    template <typename T, typename... ArgTs>
+    T *create(ArgTs &&...Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "arena-allocated AST nodes are never destroyed");
+        ++NodeCount;
+        llvm::BumpPtrAllocator &Arena = std::is_same<T, PrototypeAST>::value ? Allocator : BodyAllocator;
+        return new (Arena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+    }
+
+    // Operand lists belong to bodies; argument names and types to prototypes.
+    template <typename T>
+    llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> Elts) {
+        if (Elts.empty())
+            return {};
+        llvm::BumpPtrAllocator &Arena = std::is_same<T, ExprAST *>::value ? BodyAllocator : Allocator;
+        T *Mem = Arena.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    // Equal identifiers share storage, so they can be compared by pointer.
+    llvm::StringRef intern(llvm::StringRef Str) { return Identifiers.save(Str); }
+
+    // Frees every node except prototypes, keeping memory flat however many
+    // definitions a file has. Nothing may point into a body afterwards.
+    void releaseBodies() { BodyAllocator.Reset(); }
+
+    uint64_t getNodeCount() const { return NodeCount; }
+};
+
+} // end anonymous namespace
+
+llvm::Type *ToyType::getLLVMType(llvm::LLVMContext &C) const {
+    llvm::Type *Scalar;
+    switch (getDefault().K) {
+        case I64: Scalar = llvm::Type::getInt64Ty(C); break;
+        case F32: Scalar = llvm::Type::getFloatTy(C); break;
+        case F64: Scalar = llvm::Type::getDoubleTy(C); break;
+        default: Scalar = llvm::Type::getInt32Ty(C); break;
+    }
+    return isVector() ? llvm::FixedVectorType::get(Scalar, Lanes) : Scalar;
+}
+
+std::string ToyType::str() const {
+    static const char *const Names[] = {"i32", "i64", "f32", "f64", "integer literal", "float literal"};
+    std::string Str = Names[K];
+    if (isVector())
+        Str += "x" + std::to_string(Lanes);
+    return Str;
+}
+
+static BuiltinKind getBuiltin(llvm::StringRef Name) {
+    return llvm::StringSwitch<BuiltinKind>(Name)
+            .Case("min", BI_Min)
+            .Case("max", BI_Max)
+            .Case("abs", BI_Abs)
+            .Case("sqrt", BI_Sqrt)
+            .Case("fma", BI_FMA)
+            .Default(BI_None);
+}
+
+static unsigned getBuiltinArity(BuiltinKind B) {
+    switch (B) {
+        case BI_Abs:
+        case BI_Sqrt: return 1;
+        case BI_FMA: return 3;
+        default: return 2;
+    }
+}
+
+// sqrt and fma have no integer forms; the others work on every type.
+static bool isFloatOnlyBuiltin(BuiltinKind B) { return B == BI_Sqrt || B == BI_FMA; }
+
+static std::string getOperatorSpelling(char Op) {
+    switch (Op) {
+        case op_shl: return "<<";
+        case op_shr: return ">>";
+        default: return std::string(1, Op);
+    }
+}
+
+static bool isShift(char Op) { return Op == op_shl || Op == op_shr; }
+
+llvm::Optional<ToyType> ToyType::parse(llvm::StringRef Name) {
+    Kind K;
+    if (Name.consume_front("i32"))
+        K = I32;
+    else if (Name.consume_front("i64"))
+        K = I64;
+    else if (Name.consume_front("f32"))
+        K = F32;
+    else if (Name.consume_front("f64"))
+        K = F64;
+    else
+        return llvm::None;
+
+    if (Name.empty())
+        return ToyType(K);
+
+    unsigned Lanes;
+    if (!Name.consume_front("x") || Name.getAsInteger(10, Lanes) || Lanes < 2 || Lanes > 64 ||
+        !llvm::isPowerOf2_32(Lanes))
+        return llvm::None;
+    return ToyType(K, Lanes);
+}
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+class Parser {
+    Lexer &Lex;
+    ASTContext &AST;
+    llvm::raw_ostream &Errs;
+    int CurTok = 0;
+
+    // Indexed directly by the operator character; 0 means "not an operator".
+    int BinopPrecedence[256] = {};
+
+    // Names visible in the function being parsed, keyed by interned identifier
+    // (equal names share one pointer), mapped to their slot.
+    llvm::DenseMap<const char *, unsigned> ScopeSlots;
+    unsigned NumSlots = 0;
+
+    void BeginFunctionScope(llvm::ArrayRef<llvm::StringRef> Params);
+
+    int GetTokPrecedence();
+
+    ExprAST *LogError(const char *Str);
+    PrototypeAST *LogErrorP(const char *Str);
+
+    ExprAST *ParseExpression();
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParseIfExpr();
+    ExprAST *ParseForExpr();
+    ExprAST *ParsePrimary();
+    bool ParseType(ToyType &Ty);
+    PrototypeAST *ParsePrototype();
+public:
+    Parser(Lexer &Lex, ASTContext &AST, llvm::raw_ostream &Errs);
+
+    int getCurTok() const { return CurTok; }
+    int getNextToken(){
+        return CurTok = Lex.getok();
+    }
+
+    FunctionAST *ParseDefinition();
+    FunctionAST *ParseTopLevelExpr();
+    PrototypeAST *ParseExtern();
+};
+
+} // end anonymous namespace
+
+Parser::Parser(Lexer &Lex, ASTContext &AST, llvm::raw_ostream &Errs) : Lex(Lex), AST(AST), Errs(Errs) {
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence[op_shl] = 15;
+    BinopPrecedence[op_shr] = 15;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+    BinopPrecedence['/'] = 40;
+    BinopPrecedence['%'] = 40;
+}
+
+int Parser::GetTokPrecedence(){
+    if(CurTok < 0 || CurTok > 255)
+        return -1;
+
+    int TokPrec = BinopPrecedence[CurTok];
+    if(TokPrec <= 0)
+        return -1;
+
+    return TokPrec;
+}
+
+void Parser::BeginFunctionScope(llvm::ArrayRef<llvm::StringRef> Params){
+    ScopeSlots.clear();
+    NumSlots = 0;
+    for (llvm::StringRef Param : Params)
+        ScopeSlots[Param.data()] = NumSlots++;
+}
+
+ExprAST *Parser::LogError(const char *Str){
+    Errs << "Error: " << Str << "\n";
+    return nullptr;
+}
+PrototypeAST *Parser::LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+ExprAST *Parser::ParseNumberExpr(){
+    NumericLiteral Val{Lex.getNumVal(), 0, Lex.getNumStr().contains('.')};
+    if (!Val.IsFloat && Lex.getNumStr().getAsInteger(10, Val.IntVal))
+        return LogError("integer literal is too large");
+    auto Result = AST.create<NumberExprAST>(Val);
+    getNextToken();
+    return Result;
+}
+
+ExprAST *Parser::ParseIdentifierExpr(){
+    llvm::StringRef IdName = AST.intern(Lex.getIdentifier());
+    getNextToken(); // eat identifier.
+
+    if(CurTok != '('){ // Simple variable ref.
+        auto Slot = ScopeSlots.find(IdName.data());
+        return AST.create<VariableExprAST>(IdName, Slot == ScopeSlots.end()
+                ? VariableExprAST::UnresolvedSlot : Slot->second);
+    }
+
+    // Call.
+    getNextToken(); // eat (
+    llvm::SmallVector<ExprAST *, 8> Args;
+    if(CurTok != ')'){
+        while(true){
+            if (auto Arg = ParseExpression())
+                Args.push_back(Arg);
+            else
+                return nullptr;
+
+            if(CurTok == ')')
+                break;
+
+            if (CurTok != ',')
+                return LogError("Expected ')' or ',' in argument list");
+            getNextToken();
+        }
+    }
+    getNextToken(); // eat ).
+    return AST.create<CallExprAST>(IdName, AST.copyArray<ExprAST *>(Args));
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+ExprAST *Parser::ParseIfExpr(){
+    getNextToken(); // eat the if.
+
+    ExprAST *Cond = ParseExpression();
+    if (!Cond)
+        return nullptr;
+
+    if (CurTok != tok_then)
+        return LogError("expected then");
+    getNextToken(); // eat the then.
+
+    ExprAST *Then = ParseExpression();
+    if (!Then)
+        return nullptr;
+
+    if (CurTok != tok_else)
+        return LogError("expected else");
+    getNextToken(); // eat the else.
+
+    ExprAST *Else = ParseExpression();
+    if (!Else)
+        return nullptr;
+
+    return AST.create<IfExprAST>(Cond, Then, Else);
+}
+
+/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+ExprAST *Parser::ParseForExpr(){
+    getNextToken(); // eat the for.
+
+    if (CurTok != tok_indentifier)
+        return LogError("expected identifier after for");
+    llvm::StringRef IdName = AST.intern(Lex.getIdentifier());
+    getNextToken(); // eat identifier.
+
+    if (CurTok != '=')
+        return LogError("expected '=' after for");
+    getNextToken(); // eat '='.
+
+    // The start value is parsed before the loop variable comes into scope.
+    ExprAST *Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken();
+
+    // The variable gets a fresh slot that shadows any outer name until the
+    // end of the body.
+    unsigned Slot = NumSlots++;
+    auto Shadowed = ScopeSlots.find(IdName.data());
+    llvm::Optional<unsigned> OuterSlot;
+    if (Shadowed != ScopeSlots.end())
+        OuterSlot = Shadowed->second;
+    ScopeSlots[IdName.data()] = Slot;
+    auto RestoreScope = llvm::make_scope_exit([&] {
+        if (OuterSlot)
+            ScopeSlots[IdName.data()] = *OuterSlot;
+        else
+            ScopeSlots.erase(IdName.data());
+    });
+
+    ExprAST *End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    // The step value is optional.
+    ExprAST *Step = nullptr;
+    if (CurTok == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step)
+            return nullptr;
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken(); // eat 'in'.
+
+    ExprAST *Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return AST.create<ForExprAST>(IdName, Slot, Start, End, Step, Body);
+}
+
+ExprAST *Parser::ParsePrimary(){
+    switch(CurTok){
+        default:
+            return LogError("unknown token when expecting an expression");
+        case tok_indentifier:
+            return ParseIdentifierExpr();
+        case tok_number:
+            return ParseNumberExpr();
+        case tok_if:
+            return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+    }
+}
+
+// Operator-precedence parsing with explicit operand and operator stacks instead
+// of recursion, so `a+b+c+...` chains of any length, and parentheses nested
+// to any depth, parse in bounded stack space. An open parenthesis sits on the
+// operator stack as a marker that binds looser than every operator, so
+// nothing reduces past it until its ')' arrives. Between markers,
+// precedences on the operator stack are strictly increasing.
+ExprAST *Parser::ParseExpression(){
+    static constexpr int ParenMarker = 0;
+    llvm::SmallVector<ExprAST *, 8> Operands;
+    llvm::SmallVector<std::pair<int, int>, 8> Operators; // (operator, precedence)
+    unsigned OpenParens = 0;
+
+    auto Reduce = [&] {
+        ExprAST *RHS = Operands.pop_back_val();
+        ExprAST *L = Operands.pop_back_val();
+        Operands.push_back(AST.create<BinaryExprAST>(Operators.pop_back_val().first, L, RHS));
+    };
+    // Folds the operators above the innermost marker, or all of them.
+    auto ReduceGroup = [&] {
+        while (!Operators.empty() && Operators.back().second != ParenMarker)
+            Reduce();
+    };
+
+    while (true) {
+        for (; CurTok == '('; ++OpenParens) {
+            Operators.push_back({'(', ParenMarker});
+            getNextToken(); // eat (.
+        }
+        auto Operand = ParsePrimary();
+        if (!Operand)
+            return nullptr;
+        Operands.push_back(Operand);
+
+        // Close groups until an operator continues the expression.
+        int TokPrec;
+        while ((TokPrec = GetTokPrecedence()) < 0) {
+            if (!OpenParens) {
+                ReduceGroup();
+                return Operands.back();
+            }
+            if (CurTok != ')')
+                return LogError("expected ')'");
+            ReduceGroup();
+            Operators.pop_back(); // the marker
+            --OpenParens;
+            getNextToken(); // eat ).
+        }
+
+        // Operators are left-associative: fold everything that binds at least
+        // as tightly as this one before pushing it.
+        while (!Operators.empty() && Operators.back().second >= TokPrec)
+            Reduce();
+        Operators.push_back({CurTok, TokPrec});
+        getNextToken();
+    }
+}
+
+/// type ::= ':' identifier
+bool Parser::ParseType(ToyType &Ty){
+    getNextToken(); // eat ':'.
+    if (CurTok != tok_indentifier) {
+        LogError("Expected type after ':'");
+        return false;
+    }
+
+    auto Parsed = ToyType::parse(Lex.getIdentifier());
+    if (!Parsed) {
+        LogError("Unknown type (expected i32, i64, f32, f64 or a vector such as f64x4)");
+        return false;
+    }
+    Ty = *Parsed;
+    getNextToken(); // eat the type.
+    return true;
+}
+
+/// prototype ::= identifier '(' (identifier type?)* ')' type?
+PrototypeAST *Parser::ParsePrototype(){
+    if (CurTok != tok_indentifier)
+        return LogErrorP("Expected function name in prototype");
+
+    llvm::StringRef FnName = AST.intern(Lex.getIdentifier());
+    getNextToken();
+
+    if (CurTok != '(')
+        return LogErrorP("Expected '(' in prototype");
+
+    llvm::SmallVector<llvm::StringRef, 8> ArgNames;
+    llvm::SmallVector<ToyType, 8> ArgTypes;
+    getNextToken(); // eat '('.
+    while (CurTok == tok_indentifier) {
+        ArgNames.push_back(AST.intern(Lex.getIdentifier()));
+        ArgTypes.push_back(ToyType::I32);
+        getNextToken();
+        if (CurTok == ':' && !ParseType(ArgTypes.back()))
+            return nullptr;
+    }
+
+    if(CurTok != ')')
+        return LogErrorP("Expected ')' in prototype");
+
+    getNextToken(); // eat ')'.
+
+    ToyType RetType = ToyType::I32;
+    if (CurTok == ':' && !ParseType(RetType))
+        return nullptr;
+
+    return AST.create<PrototypeAST>(FnName, AST.copyArray<llvm::StringRef>(ArgNames),
+                                    AST.copyArray<ToyType>(ArgTypes), RetType);
+}
+
+FunctionAST *Parser::ParseDefinition(){
+    getNextToken(); // eat def.
+    auto Proto = ParsePrototype();
+    if(!Proto)
+        return nullptr;
+
+    BeginFunctionScope(Proto->getArgs());
+    if (auto E = ParseExpression())
+        return AST.create<FunctionAST>(Proto, E, NumSlots);
+
+    return nullptr;
+}
+
+PrototypeAST *Parser::ParseExtern() {
+    getNextToken(); // eat extern.
+    return ParsePrototype();
+}
+
+FunctionAST *Parser::ParseTopLevelExpr(){
+    BeginFunctionScope({});
+    if (auto E = ParseExpression()){
+        auto Proto = AST.create<PrototypeAST>("__anon_expr", llvm::ArrayRef<llvm::StringRef>(),
+                                              llvm::ArrayRef<ToyType>(), ToyType::IntLiteral);
+        return AST.create<FunctionAST>(Proto, E, NumSlots);
+    }
+    return nullptr;
+}
+
+
+//===----------------------------------------------------------------------===//
+// Type Checking
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+// Gives every expression of a function a ToyType before codegen. Types flow
+// bottom-up from parameters, loop variables and callee signatures, and
+// literal-only subtrees are then pushed down whatever type their context
+// needs. There are no implicit conversions other than that, but a literal
+// also splats across the lanes of a vector. Both directions use explicit
+// worklists, so deep expressions need no extra stack.
+class TypeChecker {
+    const llvm::StringMap<PrototypeAST *> &Protos;
+    llvm::raw_ostream &Errs;
+    std::vector<ToyType> SlotTypes;
+    // Start value of the loop that owns each slot, or null for parameters.
+    std::vector<ExprAST *> LoopStarts;
+
+    bool error(const llvm::Twine &Msg);
+    bool resolve(ExprAST *Root, ToyType Ty);
+    bool resolveDefault(ExprAST *E) { return resolve(E, E->getType().getDefault()); }
+    bool unify(ExprAST *L, ExprAST *R, ToyType &Result, const char *What);
+    bool checkCondition(ExprAST *Cond);
+    bool finishBuiltin(CallExprAST *Call, BuiltinKind B);
+    bool finish(ExprAST *E);
+public:
+    TypeChecker(const llvm::StringMap<PrototypeAST *> &Protos, llvm::raw_ostream &Errs)
+            : Protos(Protos), Errs(Errs) {}
+
+    // Infers the return type of prototypes that leave it open.
+    bool check(FunctionAST &Fn);
+};
+
+} // end anonymous namespace
+
+bool TypeChecker::error(const llvm::Twine &Msg) {
+    Errs << "Error: " << Msg << "\n";
+    return false;
+}
+
+// Gives the literal-only subtree rooted at Root the concrete type Ty, or
+// checks that Root already has it.
+bool TypeChecker::resolve(ExprAST *Root, ToyType Ty) {
+    ToyType Current = Root->getType();
+    if (!Current.isLiteral()) {
+        if (Current != Ty)
+            return error("expected a value of type " + Ty.str() + ", found " + Current.str());
+        return true;
+    }
+    if (Current.K == ToyType::FloatLiteral && !Ty.isFloat())
+        return error("floating-point literal used as " + Ty.str());
+
+    // Only literals, operators and builtins on them, conditionals with
+    // literal arms and loops (whose value is 0) can be untyped; their other
+    // operands are already concrete and are left alone.
+    llvm::SmallVector<ExprAST *, 16> Worklist{Root};
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.pop_back_val();
+        if (!E->getType().isLiteral())
+            continue;
+        E->setType(Ty);
+        if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E)) {
+            if (isShift(Bin->getOp()) && Ty.isFloat())
+                return error("operands of '" + getOperatorSpelling(Bin->getOp()) + "' must be integers, found " +
+                             Ty.str());
+            Worklist.push_back(Bin->getLHS());
+            Worklist.push_back(Bin->getRHS());
+        } else if (auto *Call = llvm::dyn_cast<CallExprAST>(E)) {
+            Worklist.append(Call->getArgs().begin(), Call->getArgs().end());
+        } else if (auto *If = llvm::dyn_cast<IfExprAST>(E)) {
+            Worklist.push_back(If->getThen());
+            Worklist.push_back(If->getElse());
+        } else if (auto *Var = llvm::dyn_cast<VariableExprAST>(E)) {
+            // A loop variable whose start value is a literal takes the type of
+            // its first typed use, and every use must then agree.
+            ToyType &SlotTy = SlotTypes[Var->getSlot()];
+            if (SlotTy.isLiteral()) {
+                SlotTy = Ty;
+                if (!resolve(LoopStarts[Var->getSlot()], Ty))
+                    return false;
+            } else if (SlotTy != Ty) {
+                return error("loop variable '" + Var->getName() + "' is used as both " + SlotTy.str() +
+                             " and " + Ty.str());
+            }
+        }
+    }
+    return true;
+}
+
+// Brings L and R to a common type, which is still a literal type only if both
+// are literal-only.
+bool TypeChecker::unify(ExprAST *L, ExprAST *R, ToyType &Result, const char *What) {
+    ToyType LT = L->getType(), RT = R->getType();
+    if (LT.isLiteral() && RT.isLiteral()) {
+        bool IsFloat = LT.K == ToyType::FloatLiteral || RT.K == ToyType::FloatLiteral;
+        Result = IsFloat ? ToyType::FloatLiteral : ToyType::IntLiteral;
+        return true;
+    }
+    if (LT.isLiteral()) {
+        Result = RT;
+        return resolve(L, RT);
+    }
+    if (RT.isLiteral()) {
+        Result = LT;
+        return resolve(R, LT);
+    }
+    if (LT != RT)
+        return error(llvm::Twine(What) + " have different types (" + LT.str() + " and " + RT.str() + ")");
+    Result = LT;
+    return true;
+}
+
+bool TypeChecker::checkCondition(ExprAST *Cond) {
+    if (!resolveDefault(Cond))
+        return false;
+    if (Cond->getType().isVector())
+        return error("condition must be a scalar, found " + Cond->getType().str());
+    return true;
+}
+
+// A builtin takes and returns a single type, which stays a literal type while
+// every argument is literal-only.
+bool TypeChecker::finishBuiltin(CallExprAST *Call, BuiltinKind B) {
+    llvm::ArrayRef<ExprAST *> Args = Call->getArgs();
+    if (Args.size() != getBuiltinArity(B))
+        return error("Incorrect # arguments passed");
+
+    ToyType Ty = ToyType::IntLiteral;
+    for (ExprAST *Arg : Args) {
+        ToyType ArgTy = Arg->getType();
+        if (!ArgTy.isLiteral()) {
+            Ty = ArgTy;
+            break;
+        }
+        if (ArgTy.K == ToyType::FloatLiteral)
+            Ty = ToyType::FloatLiteral;
+    }
+    if (!Ty.isLiteral())
+        for (ExprAST *Arg : Args)
+            if (!resolve(Arg, Ty))
+                return false;
+
+    if (isFloatOnlyBuiltin(B)) {
+        if (Ty.K == ToyType::IntLiteral)
+            Ty = ToyType::FloatLiteral;
+        else if (!Ty.isFloat())
+            return error("'" + Call->getCallee() + "' takes floating-point arguments, found " + Ty.str());
+    }
+    Call->setBuiltin(B);
+    Call->setType(Ty);
+    return true;
+}
+
+// Types E once all of its operands have been typed.
+bool TypeChecker::finish(ExprAST *E) {
+    switch (E->getKind()) {
+        case ExprAST::EK_Number:
+            E->setType(llvm::cast<NumberExprAST>(E)->getVal().IsFloat ? ToyType::FloatLiteral
+                                                                      : ToyType::IntLiteral);
+            return true;
+        case ExprAST::EK_Variable: {
+            unsigned Slot = llvm::cast<VariableExprAST>(E)->getSlot();
+            if (Slot >= SlotTypes.size())
+                return error("Unknown variable name");
+            E->setType(SlotTypes[Slot]);
+            return true;
+        }
+        case ExprAST::EK_Binary: {
+            auto *Bin = llvm::cast<BinaryExprAST>(E);
+            ToyType Ty;
+            if (!unify(Bin->getLHS(), Bin->getRHS(), Ty, "operands of a binary operator"))
+                return false;
+            if (isShift(Bin->getOp()) && Ty.isFloat())
+                return error("operands of '" + getOperatorSpelling(Bin->getOp()) + "' must be integers, found " +
+                             Ty.str());
+            if (Bin->getOp() != '<') {
+                E->setType(Ty);
+                return true;
+            }
+            // Comparisons yield 0 or 1 per lane as i32, whatever they compare.
+            if (Ty.isLiteral() && (!resolveDefault(Bin->getLHS()) || !resolveDefault(Bin->getRHS())))
+                return false;
+            E->setType(ToyType(ToyType::I32, Ty.Lanes));
+            return true;
+        }
+        case ExprAST::EK_Call: {
+            auto *Call = llvm::cast<CallExprAST>(E);
+            PrototypeAST *Callee = Protos.lookup(Call->getCallee());
+            if (!Callee) {
+                if (BuiltinKind B = getBuiltin(Call->getCallee()))
+                    return finishBuiltin(Call, B);
+                return error("Unknown function referenced");
+            }
+            if (Callee->getArgTypes().size() != Call->getArgs().size())
+                return error("Incorrect # arguments passed");
+            for (unsigned I = 0, N = Call->getArgs().size(); I != N; ++I)
+                if (!resolve(Call->getArgs()[I], Callee->getArgTypes()[I]))
+                    return false;
+            E->setType(Callee->getRetType().getDefault());
+            return true;
+        }
+        case ExprAST::EK_If: {
+            auto *If = llvm::cast<IfExprAST>(E);
+            ToyType Ty;
+            if (!checkCondition(If->getCond()) ||
+                !unify(If->getThen(), If->getElse(), Ty, "the arms of an if"))
+                return false;
+            E->setType(Ty);
+            return true;
+        }
+        case ExprAST::EK_For: {
+            auto *For = llvm::cast<ForExprAST>(E);
+            if (!checkCondition(For->getEnd()) || !resolveDefault(For->getBody()))
+                return false;
+
+            // If no use fixed the loop variable's type, the start and step
+            // values decide it, as for any other literal expression.
+            ToyType &VarTy = SlotTypes[For->getSlot()];
+            if (VarTy.isLiteral()) {
+                ToyType Ty = VarTy;
+                if (For->getStep() && !unify(For->getStart(), For->getStep(), Ty, "loop start and step values"))
+                    return false;
+                VarTy = Ty.getDefault();
+                if (!resolve(For->getStart(), VarTy))
+                    return false;
+            }
+            if (For->getStep() && !resolve(For->getStep(), VarTy))
+                return false;
+            E->setType(ToyType::IntLiteral); // the loop's value, 0, fits anywhere
+            return true;
+        }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+bool TypeChecker::check(FunctionAST &Fn) {
+    PrototypeAST &Proto = *Fn.getProto();
+    SlotTypes.assign(Fn.getNumSlots(), ToyType());
+    LoopStarts.assign(Fn.getNumSlots(), nullptr);
+    std::copy(Proto.getArgTypes().begin(), Proto.getArgTypes().end(), SlotTypes.begin());
+
+    // Stage 0 schedules a node's operands and stage 1 types the node. A loop
+    // has an extra step between typing its start value and the rest, because
+    // the start value gives the loop variable its (possibly literal) type.
+    struct WorkItem {
+        ExprAST *E;
+        unsigned Stage;
+    };
+    llvm::SmallVector<WorkItem, 64> Worklist{{Fn.getBody(), 0}};
+
+    while (!Worklist.empty()) {
+        WorkItem Item = Worklist.pop_back_val();
+        ExprAST *E = Item.E;
+
+        if (Item.Stage == 0) {
+            Worklist.push_back({E, 1});
+            if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E)) {
+                Worklist.push_back({Bin->getRHS(), 0});
+                Worklist.push_back({Bin->getLHS(), 0});
+            } else if (auto *Call = llvm::dyn_cast<CallExprAST>(E)) {
+                for (ExprAST *Arg : llvm::reverse(Call->getArgs()))
+                    Worklist.push_back({Arg, 0});
+            } else if (auto *If = llvm::dyn_cast<IfExprAST>(E)) {
+                Worklist.push_back({If->getElse(), 0});
+                Worklist.push_back({If->getThen(), 0});
+                Worklist.push_back({If->getCond(), 0});
+            } else if (auto *For = llvm::dyn_cast<ForExprAST>(E)) {
+                Worklist.push_back({For->getStart(), 0});
+            }
+            continue;
+        }
+
+        if (auto *For = llvm::dyn_cast<ForExprAST>(E)) {
+            if (Item.Stage == 1) {
+                SlotTypes[For->getSlot()] = For->getStart()->getType();
+                LoopStarts[For->getSlot()] = For->getStart();
+                Worklist.push_back({E, 2});
+                Worklist.push_back({For->getBody(), 0});
+                if (For->getStep())
+                    Worklist.push_back({For->getStep(), 0});
+                Worklist.push_back({For->getEnd(), 0});
+                continue;
+            }
+        }
+
+        if (!finish(E))
+            return false;
+    }
+
+    ExprAST *Body = Fn.getBody();
+    if (Proto.getRetType().isLiteral()) {
+        if (!resolveDefault(Body))
+            return false;
+        Proto.setRetType(Body->getType());
+        return true;
+    }
+    return resolve(Body, Proto.getRetType());
+}
+
+//===----------------------------------------------------------------------===//
+// AST Simplification
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+// Rewrites a type-checked function body before codegen: folds operators on
+// constants, applies algebraic identities, and hash-conses identical pure
+// subtrees so that each distinct computation reaches LLVM once. Merged nodes
+// are flagged as shared for the codegen memo. Calls and loops may have side
+// effects, so they are never merged or dropped. Works bottom-up with an
+// explicit worklist.
+class ASTSimplifier {
+    ASTContext &AST;
+
+    // Kind, operator and type packed together, then two operands: canonical
+    // child pointers, a slot, or a constant's bits.
+    using NodeKey = std::tuple<uint32_t, uint64_t, uint64_t>;
+    llvm::DenseMap<NodeKey, ExprAST *> Canonical;
+    // Nodes that contain a call or a loop.
+    llvm::DenseSet<const ExprAST *> Effects;
+
+    ExprAST *intern(ExprAST *E, NodeKey Key);
+    ExprAST *makeNumber(NumericLiteral Val, ToyType Ty);
+    ExprAST *simplifyBinary(BinaryExprAST *Bin, ExprAST *L, ExprAST *R);
+    ExprAST *simplifyNode(ExprAST *E, llvm::ArrayRef<ExprAST *> Ops);
+public:
+    explicit ASTSimplifier(ASTContext &AST) : AST(AST) {}
+    ExprAST *simplify(ExprAST *Root);
+};
+
+} // end anonymous namespace
+
+static void getOperands(ExprAST *E, llvm::SmallVectorImpl<ExprAST *> &Ops) {
+    switch (E->getKind()) {
+        case ExprAST::EK_Number:
+        case ExprAST::EK_Variable:
+            break;
+        case ExprAST::EK_Binary: {
+            auto *Bin = llvm::cast<BinaryExprAST>(E);
+            Ops.append({Bin->getLHS(), Bin->getRHS()});
+            break;
+        }
+        case ExprAST::EK_Call:
+            Ops.append(llvm::cast<CallExprAST>(E)->getArgs().begin(), llvm::cast<CallExprAST>(E)->getArgs().end());
+            break;
+        case ExprAST::EK_If: {
+            auto *If = llvm::cast<IfExprAST>(E);
+            Ops.append({If->getCond(), If->getThen(), If->getElse()});
+            break;
+        }
+        case ExprAST::EK_For: {
+            auto *For = llvm::cast<ForExprAST>(E);
+            Ops.append({For->getStart(), For->getEnd()});
+            if (For->getStep())
+                Ops.push_back(For->getStep());
+            Ops.push_back(For->getBody());
+            break;
+        }
+    }
+}
+
+static unsigned getIntegerWidth(ToyType Ty) { return Ty.K == ToyType::I64 ? 64 : 32; }
+
+// A constant as a value of its (concrete) type.
+static double getFPValue(const NumericLiteral &Val) { return Val.IsFloat ? Val.FPVal : (double)Val.IntVal; }
+static llvm::APInt getIntValue(const NumericLiteral &Val, ToyType Ty) {
+    return llvm::APInt(getIntegerWidth(Ty), Val.IntVal, /*isSigned=*/true);
+}
+
+// Integer division and remainder trap on a zero divisor, unless it is a
+// non-zero constant.
+static bool mayTrap(char Op, ExprAST *Divisor) {
+    if ((Op != '/' && Op != '%') || Divisor->getType().isFloat())
+        return false;
+    auto *Num = llvm::dyn_cast<NumberExprAST>(Divisor);
+    return !Num || getIntValue(Num->getVal(), Divisor->getType()).isZero();
+}
+
+static bool isConstant(ExprAST *E, int64_t V) {
+    auto *Num = llvm::dyn_cast<NumberExprAST>(E);
+    if (!Num)
+        return false;
+    if (E->getType().isFloat())
+        return getFPValue(Num->getVal()) == (double)V;
+    return getIntValue(Num->getVal(), E->getType()) == llvm::APInt(getIntegerWidth(E->getType()), V, true);
+}
+
+// Evaluates L Op R as codegen would: integers wrap at their width, shift
+// amounts are taken modulo it, f32 arithmetic is rounded to float, and '<'
+// yields 0 or 1. Integer division by zero traps, so it is left to run.
+static bool foldConstants(char Op, ToyType Ty, const NumericLiteral &L, const NumericLiteral &R,
+                          NumericLiteral &Result) {
+    if (Ty.isFloat()) {
+        double A = getFPValue(L), B = getFPValue(R), V;
+        if (Ty.K == ToyType::F32) {
+            A = (float)A;
+            B = (float)B;
+        }
+        switch (Op) {
+            case '+': V = A + B; break;
+            case '-': V = A - B; break;
+            case '*': V = A * B; break;
+            case '/': V = A / B; break;
+            case '%': V = std::fmod(A, B); break;
+            case '<': Result = NumericLiteral{0, A < B, false}; return true;
+            default: return false;
+        }
+        if (Ty.K == ToyType::F32)
+            V = (float)V;
+        Result = NumericLiteral{V, 0, true};
+        return true;
+    }
+
+    llvm::APInt A = getIntValue(L, Ty), B = getIntValue(R, Ty), V;
+    switch (Op) {
+        case '+': V = A + B; break;
+        case '-': V = A - B; break;
+        case '*': V = A * B; break;
+        case '/':
+        case '%':
+            if (B.isZero())
+                return false;
+            V = Op == '/' ? A.sdiv(B) : A.srem(B); // INT_MIN / -1 wraps to INT_MIN
+            break;
+        case op_shl: V = A.shl(B.getZExtValue() & (A.getBitWidth() - 1)); break;
+        case op_shr: V = A.ashr(B.getZExtValue() & (A.getBitWidth() - 1)); break;
+        case '<': Result = NumericLiteral{0, A.slt(B), false}; return true;
+        default: return false;
+    }
+    Result = NumericLiteral{0, V.getSExtValue(), false};
+    return true;
+}
+
+// Returns the existing node with this key, marking it shared, or registers E.
+ExprAST *ASTSimplifier::intern(ExprAST *E, NodeKey Key) {
+    auto Inserted = Canonical.insert({Key, E});
+    if (Inserted.second)
+        return E;
+    Inserted.first->second->setShared();
+    return Inserted.first->second;
+}
+
+ExprAST *ASTSimplifier::makeNumber(NumericLiteral Val, ToyType Ty) {
+    auto *Num = AST.create<NumberExprAST>(Val);
+    Num->setType(Ty);
+    return simplifyNode(Num, {});
+}
+
+ExprAST *ASTSimplifier::simplifyBinary(BinaryExprAST *Bin, ExprAST *L, ExprAST *R) {
+    char Op = Bin->getOp();
+    ToyType Ty = Bin->getType();
+    ToyType OperandTy = L->getType();
+    bool Pure = !Effects.count(L) && !Effects.count(R);
+
+    auto *LNum = llvm::dyn_cast<NumberExprAST>(L);
+    auto *RNum = llvm::dyn_cast<NumberExprAST>(R);
+    NumericLiteral Folded;
+    if (LNum && RNum && foldConstants(Op, OperandTy, LNum->getVal(), RNum->getVal(), Folded))
+        return makeNumber(Folded, Ty);
+
+    // x+0 is not x for floating-point x = -0.0, and x*0 is not 0 for NaN, so
+    // floating-point only gets the identities that hold for every value.
+    bool IsInt = !OperandTy.isFloat();
+    switch (Op) {
+        case '+':
+            if (IsInt && isConstant(R, 0)) return L;
+            if (IsInt && isConstant(L, 0)) return R;
+            break;
+        case '-':
+            if (isConstant(R, 0)) return L;
+            if (IsInt && L == R && Pure) return makeNumber(NumericLiteral{0, 0, false}, Ty);
+            break;
+        case '*':
+            if (isConstant(R, 1)) return L;
+            if (isConstant(L, 1)) return R;
+            if (IsInt && Pure && (isConstant(L, 0) || isConstant(R, 0)))
+                return makeNumber(NumericLiteral{0, 0, false}, Ty);
+            break;
+        case '/':
+            if (isConstant(R, 1)) return L;
+            break;
+        case op_shl:
+        case op_shr:
+            if (isConstant(R, 0)) return L;
+            break;
+        case '<':
+            if (L == R && Pure) // false even for NaN
+                return makeNumber(NumericLiteral{0, 0, false}, Ty);
+            break;
+    }
+
+    ExprAST *E = Bin;
+    if (L != Bin->getLHS() || R != Bin->getRHS()) {
+        E = AST.create<BinaryExprAST>(Op, L, R);
+        E->setType(Ty);
+    }
+    // A division that may trap counts as an effect, so it is never dropped.
+    if (!Pure || mayTrap(Op, R)) {
+        Effects.insert(E);
+        return E;
+    }
+    uint32_t Tag = ExprAST::EK_Binary << 24 | (uint8_t)Op << 16 | Ty.Lanes << 8 | Ty.K;
+    return intern(E, NodeKey(Tag, (uintptr_t)L, (uintptr_t)R));
+}
+
+// Simplifies E given its already simplified operands, in getOperands order.
+ExprAST *ASTSimplifier::simplifyNode(ExprAST *E, llvm::ArrayRef<ExprAST *> Ops) {
+    ToyType Ty = E->getType();
+    uint32_t Tag = E->getKind() << 24 | Ty.Lanes << 8 | Ty.K;
+
+    switch (E->getKind()) {
+        case ExprAST::EK_Number: {
+            const NumericLiteral &Val = llvm::cast<NumberExprAST>(E)->getVal();
+            uint64_t Bits;
+            if (Ty.isFloat()) {
+                double FP = getFPValue(Val);
+                memcpy(&Bits, &FP, sizeof(Bits));
+            } else {
+                Bits = getIntValue(Val, Ty).getZExtValue();
+            }
+            return intern(E, NodeKey(Tag, Bits, 0));
+        }
+        case ExprAST::EK_Variable:
+            return intern(E, NodeKey(Tag, llvm::cast<VariableExprAST>(E)->getSlot(), 0));
+        case ExprAST::EK_Binary:
+            return simplifyBinary(llvm::cast<BinaryExprAST>(E), Ops[0], Ops[1]);
+        case ExprAST::EK_Call: {
+            auto *Call = llvm::cast<CallExprAST>(E);
+            if (Ops != Call->getArgs()) {
+                E = AST.create<CallExprAST>(Call->getCallee(), AST.copyArray<ExprAST *>(Ops), Call->getBuiltin());
+                E->setType(Ty);
+            }
+            // Builtins are pure; the two-operand ones can be merged.
+            BuiltinKind B = Call->getBuiltin();
+            bool Pure = B != BI_None && llvm::none_of(Ops, [&](ExprAST *Op) { return Effects.count(Op); });
+            if (!Pure) {
+                Effects.insert(E);
+                return E;
+            }
+            if (Ops.size() > 2)
+                return E;
+            return intern(E, NodeKey(Tag | B << 16, (uintptr_t)Ops[0], Ops.size() > 1 ? (uintptr_t)Ops[1] : 0));
+        }
+        case ExprAST::EK_If: {
+            auto *If = llvm::cast<IfExprAST>(E);
+            ExprAST *Cond = Ops[0], *Then = Ops[1], *Else = Ops[2];
+            if (auto *Num = llvm::dyn_cast<NumberExprAST>(Cond)) {
+                bool Taken = Cond->getType().isFloat() ? getFPValue(Num->getVal()) != 0
+                                                       : !getIntValue(Num->getVal(), Cond->getType()).isZero();
+                return Taken ? Then : Else;
+            }
+            if (Then == Else && !Effects.count(Cond))
+                return Then;
+            if (Cond != If->getCond() || Then != If->getThen() || Else != If->getElse()) {
+                E = AST.create<IfExprAST>(Cond, Then, Else);
+                E->setType(Ty);
+            }
+            if (Effects.count(Cond) || Effects.count(Then) || Effects.count(Else))
+                Effects.insert(E);
+            return E;
+        }
+        case ExprAST::EK_For: {
+            auto *For = llvm::cast<ForExprAST>(E);
+            ExprAST *Step = For->getStep() ? Ops[2] : nullptr;
+            ExprAST *Body = Ops.back();
+            if (Ops[0] != For->getStart() || Ops[1] != For->getEnd() || Step != For->getStep() ||
+                Body != For->getBody()) {
+                E = AST.create<ForExprAST>(For->getVarName(), For->getSlot(), Ops[0], Ops[1], Step, Body);
+                E->setType(Ty);
+            }
+            Effects.insert(E);
+            return E;
+        }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+ExprAST *ASTSimplifier::simplify(ExprAST *Root) {
+    // Same two-visit scheme as FlatExpr::build; simplified operands collect
+    // on Results in getOperands order.
+    llvm::SmallVector<std::pair<ExprAST *, bool>, 64> Worklist{{Root, false}};
+    llvm::SmallVector<ExprAST *, 64> Results;
+    llvm::SmallVector<ExprAST *, 8> Ops;
+
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.back().first;
+        bool OperandsDone = Worklist.back().second;
+        Worklist.pop_back();
+
+        Ops.clear();
+        getOperands(E, Ops);
+        if (!OperandsDone) {
+            Worklist.push_back({E, true});
+            for (ExprAST *Op : llvm::reverse(Ops))
+                Worklist.push_back({Op, false});
+            continue;
+        }
+
+        llvm::SmallVector<ExprAST *, 8> NewOps(Results.end() - Ops.size(), Results.end());
+        Results.truncate(Results.size() - Ops.size());
+        Results.push_back(simplifyNode(E, NewOps));
+    }
+    return Results.back();
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+static unsigned getOptLevel(){
+    switch (OptLevel) {
+        case '0': return 0;
+        case '1': return 1;
+        case '3': return 3;
+        default: return 2;
+    }
+}
+
+static llvm::OptimizationLevel getOptimizationLevel(unsigned Level){
+    switch (Level) {
+        case 0: return llvm::OptimizationLevel::O0;
+        case 1: return llvm::OptimizationLevel::O1;
+        case 3: return llvm::OptimizationLevel::O3;
+        default: return llvm::OptimizationLevel::O2;
+    }
+}
+
+// IR-level PGO, as clang does it: -fprofile-generate adds InstrProf counters
+// to every function and -fprofile-use reads them back as branch weights and
+// entry counts, which drive inlining, block layout and select lowering.
+static llvm::Optional<llvm::PGOOptions> getPGOOptions(){
+    if (ProfileGenerate.getNumOccurrences()) {
+        llvm::SmallString<128> Path(ProfileGenerate);
+        llvm::sys::path::append(Path, "default_%m.profraw");
+        return llvm::PGOOptions(std::string(Path), "", "", llvm::PGOOptions::IRInstr);
+    }
+    if (!ProfileUse.empty()) {
+        llvm::SmallString<128> Path(ProfileUse);
+        if (llvm::sys::fs::is_directory(Path))
+            llvm::sys::path::append(Path, "default.profdata");
+        return llvm::PGOOptions(std::string(Path), "", "", llvm::PGOOptions::IRUse);
+    }
+    return llvm::None;
+}
+
+namespace {
+
+// Everything codegen needs for one translation unit. Each compilation owns its
+// own context, so independent files can be compiled on separate threads.
+class CodeGenContext {
+public:
+    llvm::TargetMachine &TM;
+    ASTContext &AST; // For nodes created after parsing, by the ASTSimplifier.
+    llvm::raw_ostream &Errs;
+    CompileStats *Stats = nullptr; // Null unless --time-report or --stats-json-file.
+    unsigned OptLevel; // -O by default; the embedding API passes its own.
+    bool NoSignedWrap = false; // --overflow=undefined: + - * and << get nsw.
+
+    std::unique_ptr<llvm::LLVMContext> TheContext;
+    std::unique_ptr<llvm::Module> TheModule;
+    std::unique_ptr<llvm::IRBuilder<>> Builder;
+    std::vector<llvm::Value *> SlotValues; // Indexed by VariableExprAST::getSlot().
+
+    // Values of shared expression nodes emitted so far. Entries made inside a
+    // branch or loop are dropped when it ends (see popValueScope), so a
+    // value is only reused where it dominates.
+    llvm::DenseMap<const ExprAST *, llvm::Value *> SharedValues;
+    std::vector<const ExprAST *> SharedValueLog;
+
+    // Prototypes outlive the module they were first emitted into, so that code
+    // added to the JIT later can redeclare functions defined in earlier modules.
+    // They point into the ASTContext, which outlives this object.
+    llvm::StringMap<PrototypeAST *> FunctionProtos;
+
+    // Content hash of every definition generated so far, for the function
+    // cache. Callers fold in their callees' hashes.
+    llvm::StringMap<std::string> FunctionHashes;
+
+    // --batch and --export names this translation unit defines. An output is
+    // only cached when it defines all of them, so a hit can mark them found.
+    unsigned RequestedFound = 0;
+
+    // Per-function cleanup pipeline, run on each definition as it is generated.
+    // The callbacks outlive the analysis managers, which point to them.
+    std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+    std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+    std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+    std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+    std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+    std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+
+    CodeGenContext(llvm::TargetMachine &TM, ASTContext &AST, llvm::raw_ostream &Errs,
+                   unsigned OptLevel = getOptLevel())
+            : TM(TM), AST(AST), Errs(Errs), OptLevel(OptLevel) {
+        InitializeModuleAndPassManager();
+    }
+
+    void InitializeModuleAndPassManager();
+    llvm::Function *getFunction(llvm::StringRef Name);
+    llvm::Value *LogErrorV(const char *Str);
+
+    // Generates E, or reuses its value if it is shared and already emitted.
+    llvm::Value *emitExpr(ExprAST *E);
+    // Generates E and returns its value from the current function.
+    bool emitReturn(ExprAST *E);
+    void emitRet(llvm::Value *V);
+    size_t pushValueScope() const { return SharedValueLog.size(); }
+    void popValueScope(size_t Mark);
+
+    // Node emitters shared by the tree walk and the flat encoding.
+    llvm::Value *emitNumber(const NumericLiteral &Val, ToyType Ty);
+    llvm::Value *emitVariable(unsigned Slot);
+    llvm::Value *emitBinary(char Op, llvm::Value *L, llvm::Value *R);
+    llvm::Value *emitDivision(char Op, llvm::Value *L, llvm::Value *R);
+    llvm::Value *emitBuiltin(BuiltinKind B, llvm::ArrayRef<llvm::Value *> Args);
+    llvm::Value *emitIsNonZero(llvm::Value *V, const char *Name);
+    llvm::Value *emitCall(llvm::StringRef Callee, llvm::ArrayRef<llvm::Value *> Args);
+    llvm::Function *checkCall(llvm::StringRef Callee, size_t NumArgs);
+    void addTargetAttributes(llvm::Function &F);
+};
+
+} // end anonymous namespace
+
+// LLVM 14's Reassociate ranks a value by recursing through its operands, so
+// a long chain it cannot fold into a multiply, such as 200,000 additions to
+// the result of an if, overflows the stack. Functions whose longest chain of
+// instructions is deeper than this get the attribute below and every
+// pipeline skips Reassociate on them; the other passes work iteratively.
+static constexpr unsigned MaxReassociateDepth = 10000;
+static constexpr const char *NoReassociateAttr = "toyc-no-reassociate";
+
+// Length of the longest chain of instructions in F each of which uses the
+// one before. PHIs start a new chain, so loops do not count.
+static unsigned getLongestUseChain(llvm::Function &F) {
+    llvm::DenseMap<const llvm::Instruction *, unsigned> Depth;
+    unsigned Longest = 0;
+    for (llvm::BasicBlock *BB : llvm::ReversePostOrderTraversal<llvm::Function *>(&F)) {
+        for (llvm::Instruction &I : *BB) {
+            unsigned D = 1;
+            if (!llvm::isa<llvm::PHINode>(I))
+                for (llvm::Value *Op : I.operands())
+                    if (auto *OpI = llvm::dyn_cast<llvm::Instruction>(Op))
+                        D = std::max(D, Depth.lookup(OpI) + 1);
+            Depth[&I] = D;
+            Longest = std::max(Longest, D);
+        }
+    }
+    return Longest;
+}
+
+static void registerPassFilters(llvm::PassInstrumentationCallbacks &PIC) {
+    PIC.registerShouldRunOptionalPassCallback([](llvm::StringRef PassID, llvm::Any IR) {
+        if (PassID != "ReassociatePass" || !llvm::any_isa<const llvm::Function *>(IR))
+            return true;
+        return !llvm::any_cast<const llvm::Function *>(IR)->hasFnAttribute(NoReassociateAttr);
+    });
+}
+
+void CodeGenContext::InitializeModuleAndPassManager(){
+    TheContext = std::make_unique<llvm::LLVMContext>();
+    TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
+    TheModule->setTargetTriple(TM.getTargetTriple().str());
+    TheModule->setDataLayout(TM.createDataLayout());
+    Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+
+    ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
+    registerPassFilters(*ThePIC);
+    TheFPM = std::make_unique<llvm::FunctionPassManager>();
+    TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
+    TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
+
+    // -O0 keeps the IR exactly as generated.
+    if (OptLevel > 0) {
+        TheFPM->addPass(llvm::InstCombinePass());
+        TheFPM->addPass(llvm::ReassociatePass());
+        TheFPM->addPass(llvm::GVNPass());
+        TheFPM->addPass(llvm::SimplifyCFGPass());
+        TheFPM->addPass(llvm::TailCallElimPass());
+    }
+
+    llvm::PassBuilder PB(&TM, llvm::PipelineTuningOptions(), llvm::None, ThePIC.get());
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+}
+
+llvm::Value *CodeGenContext::LogErrorV(const char *Str) {
+    Errs << "Error: " << Str << "\n";
+    return nullptr;
+}
+
+llvm::Function *CodeGenContext::getFunction(llvm::StringRef Name) {
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(Name))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen(*this);
+
+    return nullptr;
+}
+
+// Vector types get the value splatted across every lane.
+llvm::Value *CodeGenContext::emitNumber(const NumericLiteral &Val, ToyType Ty) {
+    llvm::Type *T = Ty.getLLVMType(*TheContext);
+    if (Ty.isFloat())
+        return llvm::ConstantFP::get(T, Val.IsFloat ? Val.FPVal : (double)Val.IntVal);
+    return llvm::ConstantInt::get(T, Val.IntVal, /*IsSigned=*/true);
+}
+
+llvm::Value *CodeGenContext::emitVariable(unsigned Slot) {
+    llvm::Value *V = Slot < SlotValues.size() ? SlotValues[Slot] : nullptr;
+    if(!V)
+        return LogErrorV("Unknown variable name");
+    return V;
+}
+
+// Both operands have the same type, scalar or vector, integer or float.
+// Shifts only take integers, and their amount is taken modulo the width (the
+// mask disappears into x86's shift instructions).
+llvm::Value *CodeGenContext::emitBinary(char Op, llvm::Value *L, llvm::Value *R) {
+    bool IsFloat = L->getType()->isFPOrFPVectorTy();
+    switch (Op) {
+        case '+':
+            return IsFloat ? Builder->CreateFAdd(L, R, "addtmp")
+                           : Builder->CreateAdd(L, R, "addtmp", /*HasNUW=*/false, NoSignedWrap);
+        case '-':
+            return IsFloat ? Builder->CreateFSub(L, R, "subtmp")
+                           : Builder->CreateSub(L, R, "subtmp", /*HasNUW=*/false, NoSignedWrap);
+        case '*':
+            return IsFloat ? Builder->CreateFMul(L, R, "multmp")
+                           : Builder->CreateMul(L, R, "multmp", /*HasNUW=*/false, NoSignedWrap);
+        case '/':
+        case '%':
+            if (IsFloat)
+                return Op == '/' ? Builder->CreateFDiv(L, R, "divtmp") : Builder->CreateFRem(L, R, "remtmp");
+            return emitDivision(Op, L, R);
+        case op_shl:
+        case op_shr: {
+            unsigned Width = L->getType()->getScalarSizeInBits();
+            R = Builder->CreateAnd(R, llvm::ConstantInt::get(R->getType(), Width - 1), "shamt");
+            return Op == op_shl ? Builder->CreateShl(L, R, "shltmp", /*HasNUW=*/false, NoSignedWrap)
+                                : Builder->CreateAShr(L, R, "shrtmp");
+        }
+        case '<': {
+            llvm::Type *BoolTy = llvm::Type::getInt32Ty(*TheContext);
+            if (auto *VT = llvm::dyn_cast<llvm::FixedVectorType>(L->getType()))
+                BoolTy = llvm::FixedVectorType::get(BoolTy, VT->getNumElements());
+            L = IsFloat ? Builder->CreateFCmpOLT(L, R, "cmptmp") : Builder->CreateICmpSLT(L, R, "cmptmp");
+            return Builder->CreateZExt(L, BoolTy, "booltmp");
+        }
+        default:
+            return LogErrorV("invalid binary operator");
+    }
+}
+
+// Whether some lane of V may be Val; only constants are known not to be.
+static bool mayHoldValue(llvm::Value *V, int64_t Val) {
+    auto *C = llvm::dyn_cast<llvm::Constant>(V);
+    if (!C)
+        return true;
+    auto *VT = llvm::dyn_cast<llvm::FixedVectorType>(V->getType());
+    for (unsigned I = 0, Lanes = VT ? VT->getNumElements() : 1; I != Lanes; ++I) {
+        auto *Elt = llvm::dyn_cast_or_null<llvm::ConstantInt>(VT ? C->getAggregateElement(I) : C);
+        if (!Elt || Elt->getSExtValue() == Val)
+            return true;
+    }
+    return false;
+}
+
+// Signed integer division or remainder. A divisor known to be neither 0 nor
+// -1 takes the fast path: a bare sdiv/srem. Otherwise a zero divisor (in any
+// lane) branches to a trap, and -1 is swapped for 1 so that INT_MIN / -1
+// cannot fault; the quotient is then -L, which wraps like every other
+// operator. --overflow=undefined drops that fix-up.
+llvm::Value *CodeGenContext::emitDivision(char Op, llvm::Value *L, llvm::Value *R) {
+    llvm::Type *Ty = R->getType();
+    if (mayHoldValue(R, 0)) {
+        llvm::Value *IsZero = Builder->CreateICmpEQ(R, llvm::Constant::getNullValue(Ty), "divzero");
+        if (Ty->isVectorTy())
+            IsZero = Builder->CreateOrReduce(IsZero);
+        llvm::Function *F = Builder->GetInsertBlock()->getParent();
+        llvm::BasicBlock *TrapBB = llvm::BasicBlock::Create(*TheContext, "divtrap", F);
+        llvm::BasicBlock *ContBB = llvm::BasicBlock::Create(*TheContext, "divcont", F);
+        Builder->CreateCondBr(IsZero, TrapBB, ContBB, llvm::MDBuilder(*TheContext).createBranchWeights(1, 1 << 20));
+        Builder->SetInsertPoint(TrapBB);
+        Builder->CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+        Builder->CreateUnreachable();
+        Builder->SetInsertPoint(ContBB);
+    }
+
+    llvm::Value *IsMinusOne = nullptr;
+    if (!NoSignedWrap && mayHoldValue(R, -1)) {
+        IsMinusOne = Builder->CreateICmpEQ(R, llvm::Constant::getAllOnesValue(Ty), "divneg1");
+        R = Builder->CreateSelect(IsMinusOne, llvm::ConstantInt::get(Ty, 1), R, "divisor");
+    }
+    llvm::Value *V = Op == '/' ? Builder->CreateSDiv(L, R, "divtmp") : Builder->CreateSRem(L, R, "remtmp");
+    if (!IsMinusOne)
+        return V;
+    llvm::Value *MinusOneV = Op == '/' ? Builder->CreateNeg(L, "negtmp") : llvm::Constant::getNullValue(Ty);
+    return Builder->CreateSelect(IsMinusOne, MinusOneV, V, Op == '/' ? "divtmp" : "remtmp");
+}
+
+// All arguments have the result's type, scalar or vector.
+llvm::Value *CodeGenContext::emitBuiltin(BuiltinKind B, llvm::ArrayRef<llvm::Value *> Args) {
+    bool IsFloat = Args[0]->getType()->isFPOrFPVectorTy();
+    switch (B) {
+        case BI_Min:
+            return IsFloat ? Builder->CreateMinNum(Args[0], Args[1], "mintmp")
+                           : Builder->CreateBinaryIntrinsic(llvm::Intrinsic::smin, Args[0], Args[1], nullptr, "mintmp");
+        case BI_Max:
+            return IsFloat ? Builder->CreateMaxNum(Args[0], Args[1], "maxtmp")
+                           : Builder->CreateBinaryIntrinsic(llvm::Intrinsic::smax, Args[0], Args[1], nullptr, "maxtmp");
+        case BI_Abs:
+            // abs(INT_MIN) is INT_MIN unless overflow is undefined.
+            return IsFloat ? Builder->CreateUnaryIntrinsic(llvm::Intrinsic::fabs, Args[0], nullptr, "abstmp")
+                           : Builder->CreateBinaryIntrinsic(llvm::Intrinsic::abs, Args[0],
+                                                            Builder->getInt1(NoSignedWrap), nullptr, "abstmp");
+        case BI_Sqrt:
+            return Builder->CreateUnaryIntrinsic(llvm::Intrinsic::sqrt, Args[0], nullptr, "sqrttmp");
+        case BI_FMA:
+            return Builder->CreateIntrinsic(llvm::Intrinsic::fma, {Args[0]->getType()}, Args, nullptr, "fmatmp");
+        case BI_None:
+            break;
+    }
+    return LogErrorV("invalid builtin");
+}
+
+// Converts a scalar condition to i1. NaN counts as true, as in C.
+llvm::Value *CodeGenContext::emitIsNonZero(llvm::Value *V, const char *Name) {
+    llvm::Value *Zero = llvm::Constant::getNullValue(V->getType());
+    if (V->getType()->isFloatingPointTy())
+        return Builder->CreateFCmpUNE(V, Zero, Name);
+    return Builder->CreateICmpNE(V, Zero, Name);
+}
+
+// Resolves a callee and checks its arity before any argument is generated.
+llvm::Function *CodeGenContext::checkCall(llvm::StringRef Callee, size_t NumArgs) {
+    llvm::Function *CalleeF = getFunction(Callee);
+    if(!CalleeF){
+        LogErrorV("Unknown function referenced");
+        return nullptr;
+    }
+
+    if(CalleeF->arg_size() != NumArgs){
+        LogErrorV("Incorrect # arguments passed");
+        return nullptr;
+    }
+    return CalleeF;
+}
+
+llvm::Value *CodeGenContext::emitCall(llvm::StringRef Callee, llvm::ArrayRef<llvm::Value *> Args) {
+    llvm::Function *CalleeF = checkCall(Callee, Args.size());
+    if(!CalleeF)
+        return nullptr;
+    return Builder->CreateCall(CalleeF, Args, "calltmp");
+}
+
+llvm::Value *CodeGenContext::emitExpr(ExprAST *E) {
+    if (!E->isShared())
+        return E->codegen(*this);
+
+    auto It = SharedValues.find(E);
+    if (It != SharedValues.end())
+        return It->second;
+    llvm::Value *V = E->codegen(*this);
+    if (V) {
+        SharedValues[E] = V;
+        SharedValueLog.push_back(E);
+    }
+    return V;
+}
+
+bool CodeGenContext::emitReturn(ExprAST *E) {
+    if (auto *If = llvm::dyn_cast<IfExprAST>(E))
+        return If->emitReturn(*this);
+    llvm::Value *V = emitExpr(E);
+    if (!V)
+        return false;
+    emitRet(V);
+    return true;
+}
+
+// A call whose result is returned at once can reuse the caller's frame.
+// Self-calls are musttail, which guarantees that at every -O level, so tail
+// recursion runs in constant stack even without TailCallElim turning it into
+// a loop. Other calls get the tail hint; there are no allocas to outlive.
+void CodeGenContext::emitRet(llvm::Value *V) {
+    llvm::BasicBlock *BB = Builder->GetInsertBlock();
+    auto *Call = llvm::dyn_cast<llvm::CallInst>(V);
+    if (Call && !BB->empty() && &BB->back() == Call)
+        Call->setTailCallKind(Call->getCalledFunction() == BB->getParent() ? llvm::CallInst::TCK_MustTail
+                                                                           : llvm::CallInst::TCK_Tail);
+    Builder->CreateRet(V);
+}
+
+void CodeGenContext::popValueScope(size_t Mark) {
+    while (SharedValueLog.size() > Mark) {
+        SharedValues.erase(SharedValueLog.back());
+        SharedValueLog.pop_back();
+    }
+}
+
+// Lets the vectorizer and instruction selector see the selected ISA.
+void CodeGenContext::addTargetAttributes(llvm::Function &F) {
+    F.addFnAttr("target-cpu", TM.getTargetCPU());
+    if (!TM.getTargetFeatureString().empty())
+        F.addFnAttr("target-features", TM.getTargetFeatureString());
+}
+
+llvm::Value *NumberExprAST::codegen(CodeGenContext &Ctx) {
+    return Ctx.emitNumber(Val, getType());
+}
+
+llvm::Value *VariableExprAST::codegen(CodeGenContext &Ctx){
+    return Ctx.emitVariable(Slot);
+}
+
+// Operators and calls are generated through the flat encoding together with
+// all their operands, so chains of any length do not recurse per node.
+llvm::Value *BinaryExprAST::codegen(CodeGenContext &Ctx) {
+    FlatExpr Flat;
+    Flat.build(this);
+    return Flat.codegen(Ctx);
+}
+
+llvm::Value *CallExprAST::codegen(CodeGenContext &Ctx){
+    FlatExpr Flat;
+    Flat.build(this);
+    return Flat.codegen(Ctx);
+}
+
+// Largest arm, in AST nodes, that is evaluated unconditionally for a select.
+static constexpr unsigned SelectArmBudget = 8;
+
+// True if E can be evaluated even when its value is not wanted: it makes no
+// calls other than to builtins (others may have side effects or recurse),
+// runs no loops, has no division that may trap, and is small enough that
+// computing it is cheaper than a mispredicted branch.
+static bool isCheapAndPure(ExprAST *Root) {
+    llvm::SmallVector<ExprAST *, 16> Worklist{Root};
+    unsigned Nodes = 0;
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.pop_back_val();
+        if (++Nodes > SelectArmBudget)
+            return false;
+        switch (E->getKind()) {
+            case ExprAST::EK_Number:
+            case ExprAST::EK_Variable:
+                break;
+            case ExprAST::EK_Binary: {
+                auto *Bin = llvm::cast<BinaryExprAST>(E);
+                if (mayTrap(Bin->getOp(), Bin->getRHS()))
+                    return false;
+                Worklist.push_back(Bin->getLHS());
+                Worklist.push_back(Bin->getRHS());
+                break;
+            }
+            case ExprAST::EK_If: {
+                auto *If = llvm::cast<IfExprAST>(E);
+                Worklist.push_back(If->getCond());
+                Worklist.push_back(If->getThen());
+                Worklist.push_back(If->getElse());
+                break;
+            }
+            case ExprAST::EK_Call: {
+                auto *Call = llvm::cast<CallExprAST>(E);
+                if (!Call->getBuiltin())
+                    return false;
+                Worklist.append(Call->getArgs().begin(), Call->getArgs().end());
+                break;
+            }
+            case ExprAST::EK_For:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Cheap, pure arms are both evaluated and picked with a select, which the
+// backend lowers to cmov/blend. Anything else gets real branches and a PHI,
+// so calls (including recursion) only run on the path that needs them.
+llvm::Value *IfExprAST::codegen(CodeGenContext &Ctx){
+    llvm::IRBuilder<> &Builder = *Ctx.Builder;
+
+    llvm::Value *CondV = Ctx.emitExpr(Cond);
+    if (!CondV)
+        return nullptr;
+    CondV = Ctx.emitIsNonZero(CondV, "ifcond");
+
+    if (isCheapAndPure(Then) && isCheapAndPure(Else)) {
+        llvm::Value *ThenV = Ctx.emitExpr(Then);
+        if (!ThenV)
+            return nullptr;
+        llvm::Value *ElseV = Ctx.emitExpr(Else);
+        if (!ElseV)
+            return nullptr;
+        return Builder.CreateSelect(CondV, ThenV, ElseV, "iftmp");
+    }
+
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*Ctx.TheContext, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*Ctx.TheContext, "else", TheFunction);
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*Ctx.TheContext, "ifcont", TheFunction);
+    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+
+    // Each arm may add blocks of its own, so the PHI takes its incoming
+    // values from wherever the arm ended.
+    size_t Scope = Ctx.pushValueScope();
+    Builder.SetInsertPoint(ThenBB);
+    llvm::Value *ThenV = Ctx.emitExpr(Then);
+    Ctx.popValueScope(Scope);
+    if (!ThenV)
+        return nullptr;
+    Builder.CreateBr(MergeBB);
+    ThenBB = Builder.GetInsertBlock();
+
+    ElseBB->moveAfter(ThenBB);
+    Builder.SetInsertPoint(ElseBB);
+    llvm::Value *ElseV = Ctx.emitExpr(Else);
+    Ctx.popValueScope(Scope);
+    if (!ElseV)
+        return nullptr;
+    Builder.CreateBr(MergeBB);
+    ElseBB = Builder.GetInsertBlock();
+
+    MergeBB->moveAfter(ElseBB);
+    Builder.SetInsertPoint(MergeBB);
+    llvm::PHINode *PN = Builder.CreatePHI(ThenV->getType(), 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+// In tail position the arms return on their own instead of meeting at a PHI,
+// so a call that ends an arm is directly followed by its ret and can become
+// a tail call (see CodeGenContext::emitRet).
+bool IfExprAST::emitReturn(CodeGenContext &Ctx) {
+    if (isCheapAndPure(Then) && isCheapAndPure(Else)) {
+        llvm::Value *V = codegen(Ctx);
+        if (!V)
+            return false;
+        Ctx.emitRet(V);
+        return true;
+    }
+
+    llvm::IRBuilder<> &Builder = *Ctx.Builder;
+    llvm::Value *CondV = Ctx.emitExpr(Cond);
+    if (!CondV)
+        return false;
+    CondV = Ctx.emitIsNonZero(CondV, "ifcond");
+
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*Ctx.TheContext, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*Ctx.TheContext, "else", TheFunction);
+    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+
+    size_t Scope = Ctx.pushValueScope();
+    Builder.SetInsertPoint(ThenBB);
+    bool Ok = Ctx.emitReturn(Then);
+    Ctx.popValueScope(Scope);
+    if (!Ok)
+        return false;
+
+    ElseBB->moveAfter(Builder.GetInsertBlock());
+    Builder.SetInsertPoint(ElseBB);
+    Ok = Ctx.emitReturn(Else);
+    Ctx.popValueScope(Scope);
+    return Ok;
+}
+
+// Emits the loop in rotated form: a guard in the current block, then a single
+// block that runs the body and tests the condition on the incremented value.
+// Together with the dedicated slot this gives LoopSimplify/IndVars a
+// canonical induction variable to vectorize and unroll.
+llvm::Value *ForExprAST::codegen(CodeGenContext &Ctx){
+    llvm::IRBuilder<> &Builder = *Ctx.Builder;
+
+    llvm::Value *StartVal = Ctx.emitExpr(Start);
+    if (!StartVal)
+        return nullptr;
+
+    // The condition is emitted three times, each with a different value for
+    // the loop variable, so shared values never carry over between them.
+    size_t Scope = Ctx.pushValueScope();
+    Ctx.SlotValues[Slot] = StartVal;
+    llvm::Value *EntryCond = Ctx.emitExpr(End);
+    Ctx.popValueScope(Scope);
+    if (!EntryCond)
+        return nullptr;
+    EntryCond = Ctx.emitIsNonZero(EntryCond, "loopguard");
+
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+    llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*Ctx.TheContext, "loop", TheFunction);
+    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*Ctx.TheContext, "afterloop", TheFunction);
+    Builder.CreateCondBr(EntryCond, LoopBB, AfterBB);
+
+    Builder.SetInsertPoint(LoopBB);
+    llvm::PHINode *Variable = Builder.CreatePHI(StartVal->getType(), 2, VarName);
+    Variable->addIncoming(StartVal, PreheaderBB);
+    Ctx.SlotValues[Slot] = Variable;
+
+    // The body's value is ignored, but an error in it is not.
+    if (!Ctx.emitExpr(Body))
+        return nullptr;
+
+    llvm::Value *StepVal = Step ? Ctx.emitExpr(Step)
+                                : Ctx.emitNumber(NumericLiteral{1, 1, false}, Start->getType());
+    Ctx.popValueScope(Scope);
+    if (!StepVal)
+        return nullptr;
+    llvm::Value *NextVar = Ctx.emitBinary('+', Variable, StepVal);
+
+    Ctx.SlotValues[Slot] = NextVar;
+    llvm::Value *EndCond = Ctx.emitExpr(End);
+    Ctx.popValueScope(Scope);
+    if (!EndCond)
+        return nullptr;
+    EndCond = Ctx.emitIsNonZero(EndCond, "loopcond");
+
+    // The body may have added blocks of its own; branch from wherever it ended.
+    llvm::BasicBlock *LoopEndBB = Builder.GetInsertBlock();
+    Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+    Variable->addIncoming(NextVar, LoopEndBB);
+
+    // Keep the exit after any blocks the body created.
+    AfterBB->moveAfter(LoopEndBB);
+    Builder.SetInsertPoint(AfterBB);
+    return llvm::Constant::getNullValue(getType().getLLVMType(*Ctx.TheContext));
+}
+
+FlatExpr::NodeID FlatExpr::addNode(Opcode Op, uint32_t OpA, uint32_t OpB, uint32_t OpC) {
+    Opcodes.push_back(Op);
+    A.push_back(OpA);
+    B.push_back(OpB);
+    C.push_back(OpC);
+    return Opcodes.size() - 1;
+}
+
+void FlatExpr::build(ExprAST *Root) {
+    // Each work item is visited twice: once to schedule its children, then
+    // again to emit it once their IDs are on the Results stack.
+    llvm::SmallVector<std::pair<ExprAST *, bool>, 64> Worklist{{Root, false}};
+    llvm::SmallVector<NodeID, 64> Results;
+    // Shared nodes are encoded once; every later use refers to the same ID,
+    // since nodes are generated in order without branching around any of
+    // them (a checked division, if or loop only continues in a block of its
+    // own), so each dominates what follows.
+    llvm::DenseMap<ExprAST *, NodeID> SharedIDs;
+
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.back().first;
+        bool ChildrenDone = Worklist.back().second;
+        Worklist.pop_back();
+
+        if (!ChildrenDone) {
+            if (E->isShared()) {
+                auto It = SharedIDs.find(E);
+                if (It != SharedIDs.end()) {
+                    Results.push_back(It->second);
+                    continue;
+                }
+            }
+            Worklist.push_back({E, true});
+            // Push in reverse so operands are emitted, and evaluated, left to right.
+            if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E)) {
+                Worklist.push_back({Bin->getRHS(), false});
+                Worklist.push_back({Bin->getLHS(), false});
+            } else if (auto *CE = llvm::dyn_cast<CallExprAST>(E)) {
+                for (ExprAST *Arg : llvm::reverse(CE->getArgs()))
+                    Worklist.push_back({Arg, false});
+            }
+            continue;
+        }
+
+        switch (E->getKind()) {
+            case ExprAST::EK_Number:
+                Constants.push_back(llvm::cast<NumberExprAST>(E)->getVal());
+                ConstantTypes.push_back(E->getType());
+                Results.push_back(addNode(Number, Constants.size() - 1));
+                break;
+            case ExprAST::EK_Variable:
+                Results.push_back(addNode(Variable, llvm::cast<VariableExprAST>(E)->getSlot()));
+                break;
+            case ExprAST::EK_Binary: {
+                NodeID RHS = Results.pop_back_val();
+                NodeID LHS = Results.pop_back_val();
+                Results.push_back(addNode(Binary, LHS, RHS, (uint8_t)llvm::cast<BinaryExprAST>(E)->getOp()));
+                break;
+            }
+            case ExprAST::EK_Call: {
+                auto *CE = llvm::cast<CallExprAST>(E);
+                size_t NumArgs = CE->getArgs().size();
+                uint32_t FirstArg = CallArgs.size();
+                CallArgs.insert(CallArgs.end(), Results.end() - NumArgs, Results.end());
+                Results.truncate(Results.size() - NumArgs);
+                Names.push_back(CE->getCallee());
+                Builtins.push_back(CE->getBuiltin());
+                Results.push_back(addNode(Call, Names.size() - 1, FirstArg, NumArgs));
+                break;
+            }
+            case ExprAST::EK_If:
+            case ExprAST::EK_For:
+                NestedExprs.push_back(E);
+                Results.push_back(addNode(Nested, NestedExprs.size() - 1));
+                break;
+        }
+        if (E->isShared())
+            SharedIDs[E] = Results.back();
+    }
+}
+
+llvm::Value *FlatExpr::codegen(CodeGenContext &Ctx) const {
+    std::vector<llvm::Value *> Values(size());
+    llvm::SmallVector<llvm::Value *, 8> ArgsV;
+
+    for (NodeID I = 0, E = size(); I != E; ++I) {
+        llvm::Value *V = nullptr;
+        switch (Opcodes[I]) {
+            case Number:
+                V = Ctx.emitNumber(Constants[A[I]], ConstantTypes[A[I]]);
+                break;
+            case Variable:
+                V = Ctx.emitVariable(A[I]);
+                break;
+            case Binary:
+                V = Ctx.emitBinary((char)C[I], Values[A[I]], Values[B[I]]);
+                break;
+            case Call:
+                ArgsV.clear();
+                for (uint32_t Arg = B[I], End = B[I] + C[I]; Arg != End; ++Arg)
+                    ArgsV.push_back(Values[CallArgs[Arg]]);
+                V = Builtins[A[I]] ? Ctx.emitBuiltin(Builtins[A[I]], ArgsV) : Ctx.emitCall(Names[A[I]], ArgsV);
+                break;
+            case Nested:
+                V = Ctx.emitExpr(NestedExprs[A[I]]);
+                break;
+        }
+        if (!V)
+            return nullptr;
+        Values[I] = V;
+    }
+    return Values.empty() ? nullptr : Values.back();
+}
+
+// Vector parameters and results map directly to the C ABI's vector types
+// (__m256d for f64x4 with AVX), so callers pass them in SIMD registers.
+llvm::FunctionType *PrototypeAST::getFunctionType(llvm::LLVMContext &C) const {
+    std::vector<llvm::Type*> Params;
+    for (ToyType Ty : ArgTypes)
+        Params.push_back(Ty.getLLVMType(C));
+    return llvm::FunctionType::get(RetType.getLLVMType(C), Params, false);
+}
+
+llvm::Function *PrototypeAST::codegen(CodeGenContext &Ctx){
+    llvm::FunctionType *FT = getFunctionType(*Ctx.TheContext);
+    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, Ctx.TheModule.get());
+
+    unsigned Idx = 0;
+    for(auto &Arg: F->args())
+        Arg.setName(Args[Idx++]);
+
+    Ctx.addTargetAttributes(*F);
+    return F;
+}
+
+static unsigned countRecursiveCalls(llvm::Function &F) {
+    unsigned Count = 0;
+    for (llvm::Use &U : F.uses())
+        if (auto *Call = llvm::dyn_cast<llvm::CallInst>(U.getUser()))
+            Count += Call->getFunction() == &F && Call->getCalledFunction() == &F;
+    return Count;
+}
+
+// --report-tail-calls: says how many self-calls TailCallElim turned into a
+// loop, and why each remaining one still is a call. OptLevel is that of the
+// compilation F came from.
+static void reportRecursiveCalls(llvm::Function &F, unsigned Before, unsigned OptLevel,
+                                 llvm::raw_ostream &Errs) {
+    unsigned After = countRecursiveCalls(F);
+    if (After < Before)
+        Errs << "Remark: '" << F.getName() << "': " << Before - After
+             << " recursive call(s) turned into a loop\n";
+
+    for (llvm::Use &U : F.uses()) {
+        auto *Call = llvm::dyn_cast<llvm::CallInst>(U.getUser());
+        if (!Call || Call->getFunction() != &F)
+            continue;
+
+        Errs << "Remark: '" << F.getName() << "': recursive call kept: ";
+        llvm::Instruction *User = Call->user_empty() ? nullptr : llvm::cast<llvm::Instruction>(*Call->user_begin());
+        if (User && llvm::isa<llvm::ReturnInst>(User))
+            Errs << (OptLevel == 0 ? "it is a tail call and reuses the frame, but -O0 keeps it a call"
+                                   : "it is a tail call that could not be turned into a loop");
+        else if (User && llvm::isa<llvm::PHINode>(User))
+            Errs << "its result is merged with another branch's before it is returned";
+        else if (User)
+            Errs << "its result is used by '" << User->getOpcodeName() << "' before it is returned";
+        else
+            Errs << "its result is discarded, so it is not in tail position";
+        Errs << "\n";
+    }
+}
+
+llvm::Function *FunctionAST::codegen(CodeGenContext &Ctx){
+    // Register the prototype so later modules can redeclare this function,
+    // and recursive calls can be checked. An invalid definition puts back
+    // whatever was registered before, so later calls do not refer to it.
+    PrototypeAST *PreviousProto = Ctx.FunctionProtos.lookup(Proto->getName());
+    Ctx.FunctionProtos[Proto->getName()] = Proto;
+    auto Fail = [&]() -> llvm::Function * {
+        if (PreviousProto)
+            Ctx.FunctionProtos[Proto->getName()] = PreviousProto;
+        else
+            Ctx.FunctionProtos.erase(Proto->getName());
+        return nullptr;
+    };
+
+    // Type checking comes first, since it fills in an inferred return type.
+    {
+        llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Codegen));
+        if (!TypeChecker(Ctx.FunctionProtos, Ctx.Errs).check(*this))
+            return Fail();
+    }
+
+    // Like the per-function pipeline, simplification is skipped at -O0.
+    if (Ctx.OptLevel > 0) {
+        llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Simplify));
+        Body = ASTSimplifier(Ctx.AST).simplify(Body);
+    }
+
+    llvm::Function *TheFunction = Ctx.getFunction(Proto->getName());
+
+    if(!TheFunction)
+        return Fail();
+
+    if(TheFunction->arg_size() != Proto->getArgs().size()){
+        Ctx.LogErrorV("Function redeclared with a different number of arguments");
+        return Fail();
+    }
+
+    if(TheFunction->getFunctionType() != Proto->getFunctionType(*Ctx.TheContext)){
+        Ctx.LogErrorV("Function redeclared with different parameter or result types");
+        return Fail();
+    }
+
+    bool Generated;
+    {
+        llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Codegen));
+        llvm::BasicBlock *BB = llvm::BasicBlock::Create(*Ctx.TheContext, "entry", TheFunction);
+        Ctx.Builder->SetInsertPoint(BB);
+
+        Ctx.SlotValues.assign(NumSlots, nullptr);
+        unsigned Slot = 0;
+        for(auto &Arg : TheFunction->args())
+            Ctx.SlotValues[Slot++] = &Arg;
+
+        Ctx.popValueScope(0); // Shared values never outlive their function.
+        Generated = Ctx.emitReturn(Body);
+    }
+
+    if(Generated){
+        {
+            llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Verify));
+            llvm::verifyFunction(*TheFunction);
+        }
+        {
+            llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::FunctionOpt));
+            unsigned RecursiveCalls = countRecursiveCalls(*TheFunction);
+            if (Ctx.OptLevel > 0 && getLongestUseChain(*TheFunction) > MaxReassociateDepth)
+                TheFunction->addFnAttr(NoReassociateAttr);
+            Ctx.TheFPM->run(*TheFunction, *Ctx.TheFAM);
+            // Top-level expressions are erased after use and a later function
+            // can reuse their address, so drop everything cached for this one.
+            Ctx.TheFAM->clear(*TheFunction, TheFunction->getName());
+            if (ReportTailCalls)
+                reportRecursiveCalls(*TheFunction, RecursiveCalls, Ctx.OptLevel, Ctx.Errs);
+        }
+        if (Ctx.Stats)
+            ++Ctx.Stats->Functions;
+        return TheFunction;
+    }
+
+    TheFunction->eraseFromParent();
+    return Fail();
+}
+
+//===----------------------------------------------------------------------===//
+// Batch Entry Points
+//===----------------------------------------------------------------------===//
+
+// --batch names seen in some module; the rest are reported once all files
+// have been compiled, since with several inputs each defines only some.
+static std::mutex BatchFoundLock;
+static llvm::StringSet<> BatchFound;
+
+// Emits Name_batch(const T0 *a0, ..., R *out, size_t n), which computes
+// out[i] = Name(a0[i], ...) for every i < n. The pointers are noalias and the
+// call is marked alwaysinline, so after inlining the loop body is the scalar
+// body itself and LoopVectorize can widen it to the target's vector width.
+static llvm::Function *emitBatchEntryPoint(CodeGenContext &Ctx, llvm::Function &Scalar) {
+    llvm::LLVMContext &C = *Ctx.TheContext;
+    llvm::Module &M = *Ctx.TheModule;
+    llvm::Type *SizeTy = M.getDataLayout().getIntPtrType(C);
+
+    std::vector<llvm::Type *> Params;
+    for (llvm::Type *ArgTy : Scalar.getFunctionType()->params())
+        Params.push_back(llvm::PointerType::getUnqual(ArgTy));
+    Params.push_back(llvm::PointerType::getUnqual(Scalar.getReturnType()));
+    Params.push_back(SizeTy);
+
+    auto *FT = llvm::FunctionType::get(llvm::Type::getVoidTy(C), Params, false);
+    auto *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Scalar.getName() + "_batch", M);
+    Ctx.addTargetAttributes(*F);
+    F->addFnAttr(llvm::Attribute::NoUnwind);
+
+    unsigned NumInputs = Scalar.arg_size();
+    for (unsigned I = 0; I != NumInputs + 1; ++I) {
+        F->addParamAttr(I, llvm::Attribute::NoAlias);
+        F->addParamAttr(I, llvm::Attribute::NoCapture);
+        F->addParamAttr(I, I == NumInputs ? llvm::Attribute::WriteOnly : llvm::Attribute::ReadOnly);
+        F->getArg(I)->setName(I == NumInputs ? llvm::Twine("out") : Scalar.getArg(I)->getName());
+    }
+    llvm::Argument *Out = F->getArg(NumInputs);
+    llvm::Argument *N = F->getArg(NumInputs + 1);
+    N->setName("n");
+
+    llvm::IRBuilder<> Builder(C);
+    llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(C, "entry", F);
+    llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(C, "loop", F);
+    llvm::BasicBlock *ExitBB = llvm::BasicBlock::Create(C, "exit", F);
+
+    Builder.SetInsertPoint(EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(N, llvm::ConstantInt::get(SizeTy, 0), "empty"), ExitBB, LoopBB);
+
+    Builder.SetInsertPoint(LoopBB);
+    llvm::PHINode *I = Builder.CreatePHI(SizeTy, 2, "i");
+    I->addIncoming(llvm::ConstantInt::get(SizeTy, 0), EntryBB);
+
+    llvm::SmallVector<llvm::Value *, 8> Args;
+    for (unsigned Arg = 0; Arg != NumInputs; ++Arg) {
+        llvm::Type *ElemTy = Scalar.getFunctionType()->getParamType(Arg);
+        llvm::Value *Ptr = Builder.CreateInBoundsGEP(ElemTy, F->getArg(Arg), I);
+        Args.push_back(Builder.CreateLoad(ElemTy, Ptr));
+    }
+    llvm::CallInst *Call = Builder.CreateCall(&Scalar, Args);
+    Call->addFnAttr(llvm::Attribute::AlwaysInline);
+    Builder.CreateStore(Call, Builder.CreateInBoundsGEP(Scalar.getReturnType(), Out, I));
+
+    llvm::Value *Next = Builder.CreateNUWAdd(I, llvm::ConstantInt::get(SizeTy, 1), "next");
+    I->addIncoming(Next, LoopBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N, "done"), ExitBB, LoopBB);
+
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateRetVoid();
+    return F;
+}
+
+// Adds the --batch entry points for the functions this module defines.
+static bool emitBatchEntryPoints(CodeGenContext &Ctx) {
+    for (const std::string &Name : BatchFunctions) {
+        llvm::Function *Scalar = Ctx.TheModule->getFunction(Name);
+        if (!Scalar || Scalar->isDeclaration())
+            continue;
+        if (Ctx.TheModule->getNamedValue(Name + "_batch")) {
+            Ctx.Errs << "Error: cannot emit '" << Name << "_batch', which is already defined\n";
+            return false;
+        }
+
+        emitBatchEntryPoint(Ctx, *Scalar);
+        ++Ctx.RequestedFound;
+        std::lock_guard<std::mutex> Lock(BatchFoundLock);
+        BatchFound.insert(Name);
+    }
+    return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Exports and Specialization
+//===----------------------------------------------------------------------===//
+
+// --export names seen in some module; like BatchFound, checked at the end.
+static std::mutex ExportFoundLock;
+static llvm::StringSet<> ExportFound;
+
+// Largest leaf function, in IR instructions, that is forced inline.
+static constexpr unsigned AlwaysInlineBudget = 16;
+// Largest function that is cloned for constant arguments, and the number of
+// clones one function may get, so recursion cannot specialize forever.
+static constexpr unsigned SpecializeBudget = 200;
+static constexpr unsigned MaxSpecializations = 4;
+
+static bool isExported(llvm::StringRef Name) {
+    for (const std::string &Export : ExportFunctions)
+        if (Name == Export)
+            return true;
+    if (!Name.endswith("_batch"))
+        return false;
+    llvm::StringRef Base = Name.drop_back(6);
+    for (const std::string &Batch : BatchFunctions)
+        if (Base == Batch)
+            return true;
+    return false;
+}
+
+// Definitions that only compute: they touch no memory and call nothing but
+// each other, so they can neither write memory nor unwind.
+static llvm::SmallPtrSet<llvm::Function *, 32> findPureFunctions(llvm::Module &M) {
+    llvm::SmallPtrSet<llvm::Function *, 32> Pure;
+    for (llvm::Function &F : M)
+        if (!F.isDeclaration())
+            Pure.insert(&F);
+
+    for (bool Changed = true; Changed;) {
+        Changed = false;
+        for (llvm::Function &F : M) {
+            if (!Pure.count(&F))
+                continue;
+            for (llvm::Instruction &I : llvm::instructions(F)) {
+                auto *Call = llvm::dyn_cast<llvm::CallBase>(&I);
+                if (Call ? !Pure.count(Call->getCalledFunction()) : I.mayReadOrWriteMemory()) {
+                    Pure.erase(&F);
+                    Changed = true;
+                    break;
+                }
+            }
+        }
+    }
+    return Pure;
+}
+
+static bool callsDefinedFunction(llvm::Function &F) {
+    for (llvm::Instruction &I : llvm::instructions(F))
+        if (auto *Call = llvm::dyn_cast<llvm::CallBase>(&I))
+            if (Call->getCalledFunction() && !Call->getCalledFunction()->isDeclaration())
+                return true;
+    return false;
+}
+
+// Clones Callee with the non-null entries of Consts in place of its
+// parameters, folding them in and pruning the branches they decide.
+static llvm::Function *cloneWithConstants(llvm::Function &Callee, llvm::ArrayRef<llvm::Constant *> Consts) {
+    llvm::SmallVector<llvm::Type *, 8> Params;
+    for (unsigned I = 0; I != Consts.size(); ++I)
+        if (!Consts[I])
+            Params.push_back(Callee.getArg(I)->getType());
+    auto *FTy = llvm::FunctionType::get(Callee.getReturnType(), Params, /*isVarArg=*/false);
+    llvm::Function *Clone = llvm::Function::Create(FTy, llvm::Function::InternalLinkage,
+                                                   Callee.getName() + ".const", Callee.getParent());
+    for (llvm::Attribute A : Callee.getAttributes().getFnAttrs())
+        Clone->addFnAttr(A);
+
+    llvm::ValueToValueMapTy VMap;
+    auto NewArg = Clone->arg_begin();
+    for (unsigned I = 0; I != Consts.size(); ++I) {
+        if (Consts[I]) {
+            VMap[Callee.getArg(I)] = Consts[I];
+        } else {
+            NewArg->setName(Callee.getArg(I)->getName());
+            VMap[Callee.getArg(I)] = &*NewArg++;
+        }
+    }
+    llvm::SmallVector<llvm::ReturnInst *, 4> Returns;
+    llvm::CloneAndPruneFunctionInto(Clone, &Callee, VMap, /*ModuleLevelChanges=*/false, Returns);
+
+    // A musttail call needs the caller's prototype, which the clone lost.
+    for (llvm::Instruction &I : llvm::instructions(*Clone))
+        if (auto *Call = llvm::dyn_cast<llvm::CallInst>(&I))
+            if (Call->isMustTailCall())
+                Call->setTailCallKind(llvm::CallInst::TCK_Tail);
+    return Clone;
+}
+
+// Redirects calls that pass constants to an internal function to a clone
+// specialized for those constants, e.g. scale(x, 3) to a scale.const(x) with
+// the 3 folded in. Clones are processed in turn, so a recursive call whose
+// argument folds to a constant is specialized as well, within the budget.
+// IPSCCP, the inliner and GlobalDCE in the module pipeline clean up after.
+static void specializeConstantArguments(llvm::Module &M) {
+    std::map<std::pair<llvm::Function *, std::vector<llvm::Constant *>>, llvm::Function *> Clones;
+    llvm::DenseMap<llvm::Function *, llvm::Function *> OriginOf;
+    llvm::DenseMap<llvm::Function *, unsigned> NumClones;
+
+    llvm::SmallVector<llvm::Function *, 32> Worklist;
+    for (llvm::Function &F : M)
+        if (!F.isDeclaration())
+            Worklist.push_back(&F);
+
+    while (!Worklist.empty()) {
+        llvm::Function *Caller = Worklist.pop_back_val();
+        llvm::SmallVector<llvm::CallInst *, 8> Calls;
+        for (llvm::Instruction &I : llvm::instructions(*Caller))
+            if (auto *Call = llvm::dyn_cast<llvm::CallInst>(&I))
+                Calls.push_back(Call);
+
+        for (llvm::CallInst *Call : Calls) {
+            llvm::Function *Callee = Call->getCalledFunction();
+            if (!Callee || Callee->isDeclaration() || !Callee->hasLocalLinkage() || Call->isMustTailCall() ||
+                Callee->hasFnAttribute(llvm::Attribute::AlwaysInline) ||
+                Callee->getInstructionCount() > SpecializeBudget)
+                continue;
+
+            std::vector<llvm::Constant *> Consts;
+            for (llvm::Value *Arg : Call->args())
+                Consts.push_back(llvm::dyn_cast<llvm::Constant>(Arg));
+            if (llvm::none_of(Consts, [](llvm::Constant *C) { return C != nullptr; }))
+                continue;
+
+            llvm::Function *&Clone = Clones[{Callee, Consts}];
+            if (!Clone) {
+                llvm::Function *Origin = OriginOf.count(Callee) ? OriginOf[Callee] : Callee;
+                if (NumClones[Origin] == MaxSpecializations)
+                    continue;
+                ++NumClones[Origin];
+                Clone = cloneWithConstants(*Callee, Consts);
+                OriginOf[Clone] = Origin;
+                Worklist.push_back(Clone);
+            }
+
+            llvm::SmallVector<llvm::Value *, 8> Args;
+            for (unsigned I = 0; I != Consts.size(); ++I)
+                if (!Consts[I])
+                    Args.push_back(Call->getArgOperand(I));
+            auto *NewCall = llvm::CallInst::Create(Clone, Args, "", Call);
+            NewCall->takeName(Call);
+            NewCall->setTailCallKind(Call->getTailCallKind());
+            Call->replaceAllUsesWith(NewCall);
+            Call->eraseFromParent();
+        }
+    }
+}
+
+// --export: every other definition gets internal linkage, so the inliner may
+// absorb it and GlobalDCE drop it. Above -O0, definitions that provably only
+// compute become readnone and nounwind, small leaves alwaysinline, and calls
+// with constant arguments are specialized.
+static void applyExports(CodeGenContext &Ctx) {
+    llvm::Module &M = *Ctx.TheModule;
+    for (llvm::Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        if (isExported(F.getName())) {
+            ++Ctx.RequestedFound;
+            std::lock_guard<std::mutex> Lock(ExportFoundLock);
+            ExportFound.insert(F.getName());
+        } else {
+            F.setLinkage(llvm::Function::InternalLinkage);
+        }
+    }
+    if (Ctx.OptLevel == 0)
+        return;
+
+    for (llvm::Function *F : findPureFunctions(M)) {
+        F->setDoesNotAccessMemory();
+        F->setDoesNotThrow();
+    }
+    for (llvm::Function &F : M)
+        if (!F.isDeclaration() && F.hasLocalLinkage() && !callsDefinedFunction(F) &&
+            F.getInstructionCount() <= AlwaysInlineBudget)
+            F.addFnAttr(llvm::Attribute::AlwaysInline);
+    specializeConstantArguments(M);
+}
+
+//===----------------------------------------------------------------------===//
+// Function Cache
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+// On-disk cache of per-function bitcode taken after the per-function pipeline.
+// Entries are keyed by a hash of everything that can change that IR, so an
+// unchanged definition is linked back in instead of being regenerated and
+// re-optimized. Shared by every compilation in the process. A resident cache
+// (--server) also keeps every entry it has read or written in memory.
+class FunctionCache {
+    std::string Dir;
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+    bool KeepResident;
+    std::mutex ResidentLock;
+    llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> Resident;
+
+    std::string getPath(llvm::StringRef Key) const {
+        llvm::SmallString<128> Path(Dir);
+        llvm::sys::path::append(Path, "fn-" + Key + ".bc");
+        return std::string(Path);
+    }
+public:
+    explicit FunctionCache(llvm::StringRef Dir, bool KeepResident = false)
+        : Dir(Dir), KeepResident(KeepResident) {}
+
+    llvm::StringRef getDir() const { return Dir; }
+
+    bool initialize(llvm::raw_ostream &Errs) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(Dir)) {
+            Errs << "Error: could not create cache directory '" << Dir << "': " << EC.message() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef Key) {
+        if (KeepResident) {
+            std::lock_guard<std::mutex> Lock(ResidentLock);
+            auto It = Resident.find(Key);
+            if (It != Resident.end())
+                return llvm::MemoryBuffer::getMemBuffer(It->second->getMemBufferRef());
+        }
+
+        auto BufOrErr = llvm::MemoryBuffer::getFile(getPath(Key));
+        if (!BufOrErr)
+            return nullptr;
+        if (KeepResident)
+            remember(Key, (*BufOrErr)->getBuffer());
+        return std::move(*BufOrErr);
+    }
+
+    void remember(llvm::StringRef Key, llvm::StringRef Bitcode) {
+        std::lock_guard<std::mutex> Lock(ResidentLock);
+        Resident[Key] = llvm::MemoryBuffer::getMemBufferCopy(Bitcode);
+    }
+
+    void store(llvm::StringRef Key, llvm::Function &F, llvm::raw_ostream &Errs);
+
+    // Counted by the caller, since an entry is only a hit once it has been
+    // read and linked.
+    void countHit() { ++Hits; }
+    void countMiss() { ++Misses; }
+    unsigned getHits() const { return Hits; }
+    unsigned getMisses() const { return Misses; }
+    void resetCounters() { Hits = Misses = 0; }
+};
+
+} // end anonymous namespace
+
+static std::unique_ptr<FunctionCache> TheFunctionCache;
+
+// Set by --server: targets, TargetMachines and the function cache outlive a
+// single compilation.
+static bool Resident = false;
+
+// Saves F alone; every other function it references becomes a declaration.
+void FunctionCache::store(llvm::StringRef Key, llvm::Function &F, llvm::raw_ostream &Errs) {
+    llvm::ValueToValueMapTy VMap;
+    std::unique_ptr<llvm::Module> Single = llvm::CloneModule(
+            *F.getParent(), VMap, [&](const llvm::GlobalValue *GV) { return GV == &F; });
+
+    llvm::SmallString<0> Bitcode;
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(*Single, OS);
+
+    llvm::SmallString<128> TempModel(Dir);
+    llvm::sys::path::append(TempModel, "fn-%%%%%%%%.tmp");
+    if (llvm::Error Err = llvm::writeFileAtomically(TempModel, getPath(Key), Bitcode))
+        llvm::logAllUnhandledErrors(std::move(Err), Errs, "Warning: could not write function cache: ");
+    if (KeepResident)
+        remember(Key, Bitcode);
+}
+
+// Hashes the prototype, the body, the hashes of direct callees (which already
+// cover their own callees), the target and optimization settings, and the
+// LLVM version, which determines the bitcode format.
+static std::string computeFunctionKey(FunctionAST &Fn, CodeGenContext &Ctx) {
+    llvm::SHA1 Hasher;
+    auto AddString = [&](llvm::StringRef Str) {
+        Hasher.update(std::to_string(Str.size()));
+        Hasher.update(":");
+        Hasher.update(Str);
+    };
+    auto AddInt = [&](uint64_t V) { AddString(std::to_string(V)); };
+
+    AddString("toyc-fn-v4"); // Bump whenever the IR generated for a node changes.
+    AddString(LLVM_VERSION_STRING);
+    AddInt(Ctx.OptLevel);
+    AddInt(Ctx.NoSignedWrap);
+    AddString(Ctx.TM.getTargetTriple().str());
+    AddString(Ctx.TM.getTargetCPU());
+    AddString(Ctx.TM.getTargetFeatureString());
+
+    PrototypeAST &Proto = *Fn.getProto();
+    AddString(Proto.getName());
+    AddInt(Proto.getArgs().size());
+    for (llvm::StringRef Arg : Proto.getArgs())
+        AddString(Arg);
+    auto AddSignature = [&](const PrototypeAST &P) {
+        for (ToyType Ty : P.getArgTypes())
+            AddString(Ty.str());
+        AddString(P.getRetType().str());
+    };
+    AddSignature(Proto);
+
+    // Pre-order walk with node kinds and child counts, which is unambiguous.
+    llvm::SmallVector<ExprAST *, 64> Worklist{Fn.getBody()};
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.pop_back_val();
+        AddInt(E->getKind());
+        switch (E->getKind()) {
+            case ExprAST::EK_Number: {
+                const NumericLiteral &Val = llvm::cast<NumberExprAST>(E)->getVal();
+                uint64_t Bits;
+                memcpy(&Bits, &Val.FPVal, sizeof(Bits));
+                AddInt(Val.IsFloat);
+                AddInt(Val.IsFloat ? Bits : (uint64_t)Val.IntVal);
+                break;
+            }
+            case ExprAST::EK_Variable:
+                AddInt(llvm::cast<VariableExprAST>(E)->getSlot());
+                break;
+            case ExprAST::EK_If: {
+                auto *If = llvm::cast<IfExprAST>(E);
+                Worklist.push_back(If->getElse());
+                Worklist.push_back(If->getThen());
+                Worklist.push_back(If->getCond());
+                break;
+            }
+            case ExprAST::EK_For: {
+                auto *For = llvm::cast<ForExprAST>(E);
+                AddInt(For->getSlot());
+                AddInt(For->getStep() != nullptr);
+                Worklist.push_back(For->getBody());
+                if (For->getStep())
+                    Worklist.push_back(For->getStep());
+                Worklist.push_back(For->getEnd());
+                Worklist.push_back(For->getStart());
+                break;
+            }
+            case ExprAST::EK_Binary: {
+                auto *Bin = llvm::cast<BinaryExprAST>(E);
+                AddInt((unsigned char)Bin->getOp());
+                Worklist.push_back(Bin->getRHS());
+                Worklist.push_back(Bin->getLHS());
+                break;
+            }
+            case ExprAST::EK_Call: {
+                auto *Call = llvm::cast<CallExprAST>(E);
+                AddString(Call->getCallee());
+                AddInt(Call->getArgs().size());
+
+                auto Hash = Ctx.FunctionHashes.find(Call->getCallee());
+                if (Call->getCallee() == Proto.getName())
+                    AddString("self");
+                else if (Hash != Ctx.FunctionHashes.end())
+                    AddString(Hash->second);
+                else if (auto *CalleeProto = Ctx.FunctionProtos.lookup(Call->getCallee()))
+                    AddSignature(*CalleeProto); // extern: only the signature matters
+                for (ExprAST *Arg : llvm::reverse(Call->getArgs()))
+                    Worklist.push_back(Arg);
+                break;
+            }
+        }
+    }
+
+    return llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+}
+
+// Generates a definition, going through the function cache when enabled.
+static llvm::Function *codegenDefinition(FunctionAST &Fn, CodeGenContext &Ctx, bool &FromCache) {
+    FromCache = false;
+    if (!TheFunctionCache)
+        return Fn.codegen(Ctx);
+
+    llvm::Timer *CacheTimer = CompileStats::get(Ctx.Stats, &CompileStats::Cache);
+    llvm::StringRef Name = Fn.getProto()->getName();
+    std::string Key;
+    {
+        llvm::TimeRegion Region(CacheTimer);
+        Key = computeFunctionKey(Fn, Ctx);
+        Ctx.FunctionHashes[Name] = Key;
+
+        if (auto Buf = TheFunctionCache->lookup(Key)) {
+            auto Cached = llvm::parseBitcodeFile(Buf->getMemBufferRef(), *Ctx.TheContext);
+            if (Cached && !llvm::Linker::linkModules(*Ctx.TheModule, std::move(*Cached))) {
+                TheFunctionCache->countHit();
+                Ctx.FunctionProtos[Name] = Fn.getProto();
+                FromCache = true;
+                return Ctx.TheModule->getFunction(Name);
+            }
+            if (!Cached)
+                llvm::consumeError(Cached.takeError());
+            Ctx.Errs << "Warning: ignoring unreadable function cache entry for '" << Name << "'\n";
+        }
+        TheFunctionCache->countMiss();
+    }
+
+    llvm::Function *F = Fn.codegen(Ctx);
+    if (F) {
+        llvm::TimeRegion Region(CacheTimer);
+        TheFunctionCache->store(Key, *F, Ctx.Errs);
+    }
+    return F;
+}
+
+//===----------------------------------------------------------------------===//
+// Object Cache
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+// On-disk store of whole outputs (objects, archives, bitcode, assembly) keyed
+// by a content hash, kept next to the function cache. AOT builds look up the
+// hash of the source and every option that shapes the output, and the JIT
+// looks up the hash of each module it is about to generate (JITObjectCache).
+class ObjectFileCache {
+    std::string Dir;
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+
+    std::string getPath(llvm::StringRef Key, llvm::StringRef Ext) const {
+        llvm::SmallString<128> Path(Dir);
+        llvm::sys::path::append(Path, "obj-" + Key + "." + Ext);
+        return std::string(Path);
+    }
+public:
+    explicit ObjectFileCache(llvm::StringRef Dir) : Dir(Dir) {}
+
+    llvm::StringRef getDir() const { return Dir; }
+
+    std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef Key, llvm::StringRef Ext) {
+        auto BufOrErr = llvm::MemoryBuffer::getFile(getPath(Key, Ext), /*IsText=*/false,
+                                                    /*RequiresNullTerminator=*/false);
+        if (!BufOrErr) {
+            ++Misses;
+            return nullptr;
+        }
+        ++Hits;
+        return std::move(*BufOrErr);
+    }
+
+    void store(llvm::StringRef Key, llvm::StringRef Ext, llvm::StringRef Bytes, llvm::raw_ostream &Errs) {
+        llvm::SmallString<128> TempModel(Dir);
+        llvm::sys::path::append(TempModel, "obj-%%%%%%%%.tmp");
+        if (llvm::Error Err = llvm::writeFileAtomically(TempModel, getPath(Key, Ext), Bytes))
+            llvm::logAllUnhandledErrors(std::move(Err), Errs, "Warning: could not write object cache: ");
+    }
+
+    unsigned getHits() const { return Hits; }
+    unsigned getMisses() const { return Misses; }
+    void resetCounters() { Hits = Misses = 0; }
+};
+
+// Lets the JIT's compile layer reuse machine code from earlier runs. A module
+// is keyed by its bitcode, which is already optimized when it gets here, and
+// by the TargetMachine settings that turn it into machine code. Top-level
+// expressions run once and are not worth storing.
+class JITObjectCache : public llvm::ObjectCache {
+    ObjectFileCache &Cache;
+    std::string TargetKey;
+    std::mutex KeysLock;
+    llvm::DenseMap<const llvm::Module *, std::string> Keys; // Misses awaiting their object.
+
+    std::string computeKey(const llvm::Module &M) const {
+        llvm::SmallString<0> Bitcode;
+        llvm::raw_svector_ostream OS(Bitcode);
+        llvm::WriteBitcodeToFile(M, OS);
+
+        llvm::SHA1 Hasher;
+        Hasher.update("toyc-jit-obj-v1");
+        Hasher.update(LLVM_VERSION_STRING);
+        Hasher.update(TargetKey);
+        Hasher.update(Bitcode);
+        return llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+    }
+public:
+    JITObjectCache(ObjectFileCache &Cache, const llvm::TargetMachine &TM) : Cache(Cache) {
+        TargetKey = (llvm::Twine(TM.getTargetTriple().str()) + "|" + TM.getTargetCPU() + "|" +
+                     TM.getTargetFeatureString() + "|" + llvm::Twine(unsigned(TM.getOptLevel()))).str();
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+        if (M->getFunction("__anon_expr"))
+            return nullptr;
+        std::string Key = computeKey(*M);
+        if (auto Buf = Cache.lookup(Key, "o"))
+            return Buf;
+        std::lock_guard<std::mutex> Lock(KeysLock);
+        Keys[M] = std::move(Key);
+        return nullptr;
+    }
+
+    void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override {
+        std::string Key;
+        {
+            std::lock_guard<std::mutex> Lock(KeysLock);
+            auto It = Keys.find(M);
+            if (It == Keys.end())
+                return;
+            Key = std::move(It->second);
+            Keys.erase(It);
+        }
+        Cache.store(Key, "o", Obj.getBuffer(), llvm::errs());
+    }
+};
+
+} // end anonymous namespace
+
+static std::unique_ptr<ObjectFileCache> TheObjectCache;
+
+//===----------------------------------------------------------------------===//
+// Top-Level Parsing and Main Loop
+//===----------------------------------------------------------------------===//
+
+// The JIT is only used for a single interactive session, never from workers.
+static std::unique_ptr<llvm::TargetMachine> JITTargetMachine;
+static std::unique_ptr<llvm::orc::LLJIT> TheJIT;
+static std::unique_ptr<JITObjectCache> TheJITObjectCache; // Set with --cache-dir.
+// Definitions added to the JIT so far. Code added after a definition calls
+// it directly, so a definition can never be replaced.
+static llvm::StringSet<> JITDefinitions;
+static llvm::ExitOnError ExitOnErr;
+
+void optimizeModule(llvm::Module &M, llvm::TargetMachine &TM, unsigned OptLevel, CompileStats *Stats);
+
+// Hands the current module to the JIT under the given tracker and starts a
+// fresh one, so earlier definitions are never recompiled.
+static bool addModuleToJIT(CodeGenContext &Ctx, llvm::orc::LLJIT &JIT, llvm::orc::ResourceTrackerSP RT) {
+    optimizeModule(*Ctx.TheModule, Ctx.TM, Ctx.OptLevel, Ctx.Stats);
+    auto TSM = llvm::orc::ThreadSafeModule(std::move(Ctx.TheModule), std::move(Ctx.TheContext));
+    Ctx.InitializeModuleAndPassManager();
+
+    if (auto Err = JIT.addIRModule(RT, std::move(TSM))) {
+        llvm::logAllUnhandledErrors(std::move(Err), Ctx.Errs, "Error: ");
+        return false;
+    }
+    return true;
+}
+
+// Parses with the parse timer running; lexing is pulled in on demand.
+template <typename ParseFn>
+static auto timedParse(CodeGenContext &Ctx, ParseFn Parse) {
+    llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Parse));
+    return Parse();
+}
+
+static void emitDefinition(FunctionAST &FnAST, CodeGenContext &Ctx) {
+    // The earlier body stays; the JIT has already linked callers against it.
+    llvm::StringRef Name = FnAST.getProto()->getName();
+    llvm::Function *Existing = Ctx.TheModule->getFunction(Name);
+    if ((Existing && !Existing->isDeclaration()) || (UseJIT && JITDefinitions.count(Name))) {
+        Ctx.Errs << "Error: function '" << Name << "' is already defined\n";
+        return;
+    }
+
+    bool FromCache;
+    if (auto *FnIR = codegenDefinition(FnAST, Ctx, FromCache)) {
+        if (PrintIR) {
+            Ctx.Errs << (FromCache ? "Read function definition (cached):" : "Read function definition:");
+            FnIR->print(Ctx.Errs);
+            Ctx.Errs << "\n";
+        }
+
+        if (UseJIT && addModuleToJIT(Ctx, *TheJIT, TheJIT->getMainJITDylib().getDefaultResourceTracker()))
+            JITDefinitions.insert(Name);
+    }
+}
+
+static void HandleDefinition(Parser &P, CodeGenContext &Ctx) {
+    if (auto FnAST = timedParse(Ctx, [&] { return P.ParseDefinition(); })) {
+        emitDefinition(*FnAST, Ctx);
+    } else {
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+}
+
+static void emitExtern(PrototypeAST &ProtoAST, CodeGenContext &Ctx) {
+    if (auto *FnIR = ProtoAST.codegen(Ctx)) {
+        if (PrintIR) {
+            Ctx.Errs << "Read extern: ";
+            FnIR->print(Ctx.Errs);
+            Ctx.Errs << "\n";
+        }
+        Ctx.FunctionProtos[ProtoAST.getName()] = &ProtoAST;
+    }
+}
+
+static void HandleExtern(Parser &P, CodeGenContext &Ctx) {
+    if (auto ProtoAST = timedParse(Ctx, [&] { return P.ParseExtern(); })) {
+        emitExtern(*ProtoAST, Ctx);
+    } else {
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+}
+
+// Calls a JIT'd top-level expression through a pointer of its inferred type.
+static void printJITResult(llvm::JITTargetAddress Addr, ToyType Ty) {
+    llvm::raw_ostream &OS = llvm::outs();
+    if (Ty.isVector()) {
+        // The host compiler and the JIT may disagree on how vectors are
+        // returned (AVX or not), so these are only run for their effects.
+        llvm::jitTargetAddressToFunction<void (*)()>(Addr)();
+        OS << "Evaluated to a " << Ty.str() << " vector (not printed)\n";
+        return;
+    }
+
+    OS << "Evaluated to ";
+    switch (Ty.K) {
+        case ToyType::I64:
+            OS << llvm::jitTargetAddressToFunction<int64_t (*)()>(Addr)();
+            break;
+        case ToyType::F32:
+            OS << llvm::format("%f", llvm::jitTargetAddressToFunction<float (*)()>(Addr)());
+            break;
+        case ToyType::F64:
+            OS << llvm::format("%f", llvm::jitTargetAddressToFunction<double (*)()>(Addr)());
+            break;
+        default:
+            OS << llvm::jitTargetAddressToFunction<int (*)()>(Addr)();
+            break;
+    }
+    OS << "\n";
+}
+
+// Evaluates a top-level expression as an anonymous function.
+static void emitTopLevelExpression(FunctionAST &FnAST, CodeGenContext &Ctx) {
+    auto *FnIR = FnAST.codegen(Ctx);
+    if (!FnIR)
+        return;
+    if (PrintIR) {
+        Ctx.Errs << "Read top-level expression:";
+        FnIR->print(Ctx.Errs);
+        Ctx.Errs << "\n";
+    }
+
+    if (!UseJIT) {
+        // Remove the anonymous expression.
+        FnIR->eraseFromParent();
+        Ctx.FunctionProtos.erase("__anon_expr");
+        return;
+    }
+
+    // Give the expression its own tracker so its memory can be freed
+    // as soon as it has run.
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (!addModuleToJIT(Ctx, *TheJIT, RT))
+        return;
+
+    auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+    printJITResult(ExprSymbol.getAddress(), FnAST.getProto()->getRetType());
+    llvm::outs().flush();
+
+    ExitOnErr(RT->remove());
+    Ctx.FunctionProtos.erase("__anon_expr");
+}
+
+static void HandleTopLevelExpression(Parser &P, CodeGenContext &Ctx) {
+    if (auto FnAST = timedParse(Ctx, [&] { return P.ParseTopLevelExpr(); })) {
+        emitTopLevelExpression(*FnAST, Ctx);
+    } else {
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+}
+
+// Prompts only when a person is typing; piped and file input is read silently.
+// OnDefinition, if given, runs after each definition has been generated.
+static void MainLoop(Parser &P, CodeGenContext &Ctx, bool ShowPrompt,
+                     llvm::function_ref<void()> OnDefinition = {}){
+    while (true){
+        if (ShowPrompt)
+            Ctx.Errs << "ready> ";
+        switch (P.getCurTok()){
+            case tok_eof:
+                return;
+            case ';':
+                P.getNextToken();
+                break;
+            case tok_def:
+                HandleDefinition(P, Ctx);
+                if (OnDefinition)
+                    OnDefinition();
+                break;
+            case tok_extern:
+                HandleExtern(P, Ctx);
+                break;
+            default:
+                HandleTopLevelExpression(P, Ctx);
+                break;
+        }
+        Ctx.AST.releaseBodies();
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel Parsing
+//===----------------------------------------------------------------------===//
+
+// Top-level items are independent until code generation resolves calls, so
+// --parse-threads cuts a large input at def and extern tokens and parses the
+// pieces concurrently, each into an arena of its own. Code is then generated
+// for the items in source order, and each prototype is registered when its
+// item is reached, so the result is the same as parsing in one piece.
+
+namespace {
+
+struct ParsedItem {
+    int Kind;                      // tok_def, tok_extern, or 0 for an expression
+    FunctionAST *Fn = nullptr;     // definitions and expressions
+    PrototypeAST *Proto = nullptr; // externs
+};
+
+// Declared before the CodeGenContext that uses it, like the main arena,
+// since registered prototypes point into AST.
+struct ParsedChunk {
+    Lexer Lex;
+    ASTContext AST;
+    std::vector<ParsedItem> Items;
+    bool Failed = false;
+};
+
+} // end anonymous namespace
+
+// Below this, a thread costs more than it saves.
+static const size_t MinParseChunkSize = 1 << 20;
+
+// Cuts Text into at most NumChunks pieces of similar size, each starting at a
+// def or extern token. Skips over identifiers and numbers as the lexer does,
+// so "undef" or "x1extern" aren't cut, without making any tokens.
+static void splitAtItems(llvm::StringRef Text, unsigned NumChunks, std::vector<llvm::StringRef> &Chunks) {
+    size_t Target = Text.size() / NumChunks;
+    size_t Start = 0, Pos = 0, End = Text.size();
+    while (Pos != End) {
+        unsigned char C = Text[Pos];
+        if (isalpha(C)) {
+            size_t Word = Pos;
+            while (Pos != End && isalnum((unsigned char)Text[Pos]))
+                ++Pos;
+            llvm::StringRef Ident = Text.slice(Word, Pos);
+            if (Word - Start >= Target && Chunks.size() + 1 < NumChunks && (Ident == "def" || Ident == "extern")) {
+                Chunks.push_back(Text.slice(Start, Word));
+                Start = Word;
+            }
+        } else if (isdigit(C) || C == '.') {
+            while (Pos != End && (isdigit((unsigned char)Text[Pos]) || Text[Pos] == '.'))
+                ++Pos;
+        } else {
+            ++Pos;
+        }
+    }
+    Chunks.push_back(Text.slice(Start, End));
+}
+
+// The items of one piece, parsed the way MainLoop parses them.
+static void parseChunk(llvm::StringRef Text, ParsedChunk &Chunk) {
+    std::string Diagnostics;
+    llvm::raw_string_ostream Errs(Diagnostics);
+    Chunk.Lex.OpenBuffer(Text);
+    Parser P(Chunk.Lex, Chunk.AST, Errs);
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof) {
+        ParsedItem Item{P.getCurTok() == tok_def || P.getCurTok() == tok_extern ? P.getCurTok() : 0};
+        if (P.getCurTok() == ';') {
+            P.getNextToken();
+            continue;
+        }
+        if (Item.Kind == tok_def)
+            Item.Fn = P.ParseDefinition();
+        else if (Item.Kind == tok_extern)
+            Item.Proto = P.ParseExtern();
+        else
+            Item.Fn = P.ParseTopLevelExpr();
+
+        // A sequential parse recovers by skipping a token, which may be the
+        // def this piece was cut at; only another parse can say what follows.
+        if (!Item.Fn && !Item.Proto) {
+            Chunk.Failed = true;
+            return;
+        }
+        Chunk.Items.push_back(Item);
+    }
+}
+
+// Parses Text on --parse-threads threads. Returns false, with Chunks empty,
+// if Text is too small to share out or does not parse cleanly; the caller
+// then parses it in one piece, which also reports any errors.
+static bool parseInParallel(llvm::StringRef Text, std::vector<std::unique_ptr<ParsedChunk>> &Chunks,
+                            CompileStats *Stats) {
+    unsigned NumThreads = llvm::hardware_concurrency(ParseThreads).compute_thread_count();
+    unsigned NumChunks = std::min<size_t>(NumThreads, Text.size() / MinParseChunkSize);
+    if (NumChunks < 2)
+        return false;
+
+    llvm::TimeRegion Region(CompileStats::get(Stats, &CompileStats::Parse));
+    std::vector<llvm::StringRef> Pieces;
+    splitAtItems(Text, NumChunks, Pieces);
+    for (size_t I = 0; I != Pieces.size(); ++I)
+        Chunks.push_back(std::make_unique<ParsedChunk>());
+
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(Pieces.size()));
+    for (size_t I = 0; I != Pieces.size(); ++I)
+        Pool.async([&, I] { parseChunk(Pieces[I], *Chunks[I]); });
+    Pool.wait();
+
+    for (const auto &Chunk : Chunks) {
+        if (Chunk->Failed) {
+            Chunks.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+// MainLoop for items that have already been parsed.
+static void generateParsedItems(llvm::ArrayRef<std::unique_ptr<ParsedChunk>> Chunks, CodeGenContext &Ctx,
+                                llvm::function_ref<void()> OnDefinition = {}) {
+    for (const auto &Chunk : Chunks) {
+        for (const ParsedItem &Item : Chunk->Items) {
+            if (Item.Kind == tok_def) {
+                emitDefinition(*Item.Fn, Ctx);
+                if (OnDefinition)
+                    OnDefinition();
+            } else if (Item.Kind == tok_extern) {
+                emitExtern(*Item.Proto, Ctx);
+            } else {
+                emitTopLevelExpression(*Item.Fn, Ctx);
+            }
+            Ctx.AST.releaseBodies();
+        }
+        Chunk->AST.releaseBodies();
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Object File Emitter
+//===----------------------------------------------------------------------===//
+
+void InitializeTargets() {
+    // Cross-compiling needs every backend; otherwise the host's is enough.
+    if (!TargetTripleOpt.empty() || !MArch.empty()) {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmPrinters();
+        llvm::InitializeAllAsmParsers();
+        return;
+    }
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+}
+
+static std::string getCPUStr(){
+    if (MCPU == "native")
+        return std::string(llvm::sys::getHostCPUName());
+    return MCPU;
+}
+
+static std::string getFeaturesStr(){
+    llvm::SubtargetFeatures Features;
+
+    // -mcpu=native implies the host's features; -mattr can still adjust them.
+    if (MCPU == "native") {
+        llvm::StringMap<bool> HostFeatures;
+        if (llvm::sys::getHostCPUFeatures(HostFeatures))
+            for (auto &F : HostFeatures)
+                Features.AddFeature(F.first(), F.second);
+    }
+
+    for (auto &Attr : MAttrs)
+        Features.AddFeature(Attr);
+
+    return Features.getString();
+}
+
+static llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned Level = getOptLevel()){
+    switch (Level) {
+        case 0: return llvm::CodeGenOpt::None;
+        case 1: return llvm::CodeGenOpt::Less;
+        case 3: return llvm::CodeGenOpt::Aggressive;
+        default: return llvm::CodeGenOpt::Default;
+    }
+}
+
+// TargetMachines are not shared between threads; every compilation creates
+// its own from the command-line settings.
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(llvm::raw_ostream &Errs){
+    llvm::Triple TheTriple(TargetTripleOpt.empty() ? llvm::sys::getDefaultTargetTriple()
+                                                   : llvm::Triple::normalize(TargetTripleOpt));
+
+    std::string Error;
+    auto Target = llvm::TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+
+    if(!Target){
+        Errs << Error << "\n";
+        return nullptr;
+    }
+
+    auto TargetTriple = TheTriple.getTriple();
+    auto CPU = getCPUStr();
+    auto Features = getFeaturesStr();
+
+    llvm::TargetOptions opt;
+    llvm::Optional<llvm::Reloc::Model> RM;
+    return std::unique_ptr<llvm::TargetMachine>(
+            Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM,
+                                        llvm::None, getCodeGenOptLevel()));
+}
+
+namespace {
+
+// Idle TargetMachines by configuration. Only --server keeps one, so a request
+// reuses the machines of earlier requests with the same target and -O level
+// instead of looking up the target and building its subtarget again.
+class TargetMachinePool {
+    std::mutex Lock;
+    std::map<std::string, std::vector<std::unique_ptr<llvm::TargetMachine>>> Idle;
+public:
+    std::unique_ptr<llvm::TargetMachine> take(const std::string &Key) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto &Machines = Idle[Key];
+        if (Machines.empty())
+            return nullptr;
+        std::unique_ptr<llvm::TargetMachine> TM = std::move(Machines.back());
+        Machines.pop_back();
+        return TM;
+    }
+
+    void give(const std::string &Key, std::unique_ptr<llvm::TargetMachine> TM) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Idle[Key].push_back(std::move(TM));
+    }
+};
+
+} // end anonymous namespace
+
+static std::unique_ptr<TargetMachinePool> TheTargetMachinePool;
+
+// Everything createTargetMachine reads from the command line.
+static std::string getTargetMachineKey() {
+    return (llvm::Twine(TargetTripleOpt) + "|" + MArch + "|" + getCPUStr() + "|" + getFeaturesStr() + "|" +
+            llvm::Twine(getOptLevel())).str();
+}
+
+// Like createTargetMachine, but reuses a pooled machine when there is one.
+// Hand it back with releaseTargetMachine once nothing refers to it.
+static std::unique_ptr<llvm::TargetMachine> acquireTargetMachine(llvm::raw_ostream &Errs) {
+    if (TheTargetMachinePool)
+        if (auto TM = TheTargetMachinePool->take(getTargetMachineKey()))
+            return TM;
+    return createTargetMachine(Errs);
+}
+
+static void releaseTargetMachine(std::unique_ptr<llvm::TargetMachine> TM) {
+    if (TheTargetMachinePool && TM)
+        TheTargetMachinePool->give(getTargetMachineKey(), std::move(TM));
+}
+
+// The JIT always targets the host; -mcpu/-mattr still refine the host CPU.
+bool InitializeJIT(){
+    if (!TargetTripleOpt.empty() || !MArch.empty()) {
+        llvm::errs() << "Error: -mtriple/-march cannot be used with --jit\n";
+        return false;
+    }
+
+    auto JTMB = ExitOnErr(llvm::orc::JITTargetMachineBuilder::detectHost());
+    if (MCPU.getNumOccurrences()) {
+        JTMB.setCPU(getCPUStr());
+        JTMB.getFeatures() = llvm::SubtargetFeatures(getFeaturesStr());
+    } else {
+        for (auto &Attr : MAttrs)
+            JTMB.getFeatures().AddFeature(Attr);
+    }
+    JTMB.setCodeGenOptLevel(getCodeGenOptLevel());
+
+    JITTargetMachine = ExitOnErr(JTMB.createTargetMachine());
+    llvm::orc::LLJITBuilder Builder;
+    Builder.setJITTargetMachineBuilder(std::move(JTMB));
+    if (TheObjectCache) {
+        // Modules compiled in an earlier run are loaded from the object cache.
+        TheJITObjectCache = std::make_unique<JITObjectCache>(*TheObjectCache, *JITTargetMachine);
+        Builder.setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder JTMB)
+                -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            auto TM = JTMB.createTargetMachine();
+            if (!TM)
+                return TM.takeError();
+            return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*TM),
+                                                                       TheJITObjectCache.get());
+        });
+    }
+    TheJIT = ExitOnErr(Builder.create());
+
+    // Let `extern` declarations resolve against symbols in this process.
+    TheJIT->getMainJITDylib().addGenerator(
+            ExitOnErr(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                    TheJIT->getDataLayout().getGlobalPrefix())));
+    return true;
+}
+
+// Runs the whole-module pipeline (inlining, GVN, vectorization, ...) that
+// matches the selected -O level, the same one clang would use.
+void optimizeModule(llvm::Module &M, llvm::TargetMachine &TM, unsigned OptLevel, CompileStats *Stats){
+    llvm::TimeRegion Region(CompileStats::get(Stats, &CompileStats::ModuleOpt));
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+
+    llvm::PassInstrumentationCallbacks PIC;
+    registerPassFilters(PIC);
+    llvm::PassBuilder PB(&TM, llvm::PipelineTuningOptions(), getPGOOptions(), &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // For LTO the linker runs the rest of the pipeline across modules, so
+    // only the pre-link half runs here.
+    llvm::OptimizationLevel Level = getOptimizationLevel(OptLevel);
+    llvm::ModulePassManager MPM;
+    if (Level == llvm::OptimizationLevel::O0)
+        MPM = PB.buildO0DefaultPipeline(Level, /*LTOPreLink=*/LTOMode != LTO_None);
+    else if (LTOMode == LTO_Thin)
+        MPM = PB.buildThinLTOPreLinkDefaultPipeline(Level);
+    else if (LTOMode == LTO_Full)
+        MPM = PB.buildLTOPreLinkDefaultPipeline(Level);
+    else
+        MPM = PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+
+    if (Stats)
+        Stats->IRInstructions += M.getInstructionCount();
+}
+
+// -j only applies to machine code; bitcode and -S output stay in one piece.
+static bool isSplitCodegen() {
+    return CodegenPartitions > 1 && !EmitLLVM && !EmitAssembly && LTOMode == LTO_None;
+}
+
+// Extension of the file written for the selected output mode. Like clang,
+// -flto keeps the .o name for its bitcode so build scripts need not change.
+static const char *getOutputExtension(){
+    if (EmitLLVM || (LTOMode != LTO_None && EmitAssembly))
+        return EmitAssembly ? "ll" : "bc";
+    if (EmitAssembly)
+        return "s";
+    return isSplitCodegen() || StreamMode ? "a" : "o";
+}
+
+// Writes bitcode carrying a module summary, which lets the linker (lld, or
+// the gold/ld64 plugins) import and inline across modules. The flags match
+// what clang sets, so the module links together with clang's own -flto output.
+static void writeLTOBitcode(llvm::Module &M, llvm::raw_ostream &OS) {
+    if (!M.getModuleFlag("ThinLTO"))
+        M.addModuleFlag(llvm::Module::Error, "ThinLTO", uint32_t(LTOMode == LTO_Thin));
+    if (!M.getModuleFlag("EnableSplitLTOUnit"))
+        M.addModuleFlag(llvm::Module::Error, "EnableSplitLTOUnit", uint32_t(0));
+
+    llvm::ModuleSummaryIndex Index = llvm::buildModuleSummaryIndex(M, nullptr, nullptr);
+    llvm::WriteBitcodeToFile(M, OS, /*ShouldPreserveUseListOrder=*/false, &Index,
+                             /*GenerateHash=*/LTOMode == LTO_Thin);
+}
+
+static llvm::object::Archive::Kind getArchiveKind(const llvm::TargetMachine &TM) {
+    return TM.getTargetTriple().isOSDarwin() ? llvm::object::Archive::K_DARWIN
+                                             : llvm::object::Archive::K_GNU;
+}
+
+// Splits the optimized module and generates an object for each partition on
+// its own thread, in its own context and with its own TargetMachine. Cross-
+// partition references are promoted to external symbols, so the objects go
+// out as one archive that links like the single object would.
+static bool emitPartitionedArchive(CodeGenContext &Ctx, llvm::raw_ostream &OS) {
+    std::vector<llvm::SmallString<0>> Objects(CodegenPartitions);
+    std::vector<std::unique_ptr<llvm::raw_svector_ostream>> Streams;
+    std::vector<llvm::raw_pwrite_stream *> OSs;
+    for (auto &Object : Objects) {
+        Streams.push_back(std::make_unique<llvm::raw_svector_ostream>(Object));
+        OSs.push_back(Streams.back().get());
+    }
+
+    // The target was validated before any input was read, so creating one
+    // more TargetMachine cannot fail.
+    llvm::splitCodeGen(*Ctx.TheModule, OSs, {}, [] { return createTargetMachine(llvm::nulls()); });
+
+    std::vector<std::string> Names;
+    std::vector<llvm::NewArchiveMember> Members;
+    for (unsigned I = 0; I != Objects.size(); ++I)
+        Names.push_back(llvm::formatv("part{0}.o", I));
+    for (unsigned I = 0; I != Objects.size(); ++I)
+        Members.emplace_back(llvm::MemoryBufferRef(Objects[I], Names[I]));
+
+    auto Archive = llvm::writeArchiveToBuffer(Members, /*WriteSymtab=*/true, getArchiveKind(Ctx.TM),
+                                              /*Deterministic=*/true, /*Thin=*/false);
+    if (!Archive) {
+        llvm::logAllUnhandledErrors(Archive.takeError(), Ctx.Errs, "Error: ");
+        return false;
+    }
+    OS << (*Archive)->getBuffer();
+    return true;
+}
+
+// Writes an optimized module as an object file, assembly, bitcode or textual
+// IR, depending on -S, --emit-llvm and -flto.
+static bool writeModule(llvm::Module &M, llvm::TargetMachine &TM, llvm::raw_pwrite_stream &OS,
+                        llvm::raw_ostream &Errs) {
+    if (EmitLLVM || LTOMode != LTO_None) {
+        if (EmitAssembly)
+            M.print(OS, nullptr);
+        else if (LTOMode != LTO_None)
+            writeLTOBitcode(M, OS);
+        else
+            llvm::WriteBitcodeToFile(M, OS);
+        return true;
+    }
+
+    llvm::legacy::PassManager pass;
+    auto FileType = EmitAssembly ? llvm::CGFT_AssemblyFile : llvm::CGFT_ObjectFile;
+
+    if(TM.addPassesToEmitFile(pass, OS, nullptr, FileType)){
+        Errs << "TargetMachine can't emit a file of this type";
+        return false;
+    }
+
+    pass.run(M);
+    return true;
+}
+
+// Optimizes the module and writes it (or its -j partitions) to Filename.
+bool compileToFile(CodeGenContext &Ctx, llvm::StringRef Filename){
+    if (!emitBatchEntryPoints(Ctx))
+        return false;
+    if (!ExportFunctions.empty())
+        applyExports(Ctx);
+    optimizeModule(*Ctx.TheModule, Ctx.TM, Ctx.OptLevel, Ctx.Stats);
+
+    std::error_code EC;
+    llvm::raw_fd_ostream dest(Filename, EC, EmitAssembly ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None);
+
+    if(EC){
+        Ctx.Errs << "Could not open file: " << EC.message();
+        return false;
+    }
+
+    llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Emit));
+    if (isSplitCodegen())
+        return emitPartitionedArchive(Ctx, dest);
+    return writeModule(*Ctx.TheModule, Ctx.TM, dest, Ctx.Errs);
+}
+
+//===----------------------------------------------------------------------===//
+// Streaming Compilation
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+// A batch of finished definitions on its way to the emitter thread. The
+// module is declared last so that it is destroyed before its context.
+struct PendingModule {
+    std::unique_ptr<llvm::LLVMContext> Context;
+    std::unique_ptr<llvm::Module> Module;
+};
+
+// With --stream, every StreamBatch definitions are moved out of the
+// CodeGenContext into a module of their own. An emitter thread optimizes
+// the module and writes it to a temporary object while parsing continues.
+// At most MaxQueued batches wait in between, so parsing stalls rather than
+// running ahead, and the IR alive at any time stays bounded however large
+// the input is. The objects become one archive at the end.
+//
+// Definitions in one batch call earlier ones through declarations, exactly
+// as JIT modules do, so inlining stops at batch boundaries.
+class StreamingEmitter {
+    static constexpr size_t MaxQueued = 2;
+
+    CodeGenContext &Ctx;
+    std::unique_ptr<llvm::TargetMachine> TM; // the emitter thread's own
+    unsigned DefinitionsInModule = 0;
+    bool FrontEndOk = true;
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<PendingModule> Queue;
+    bool Closed = false;
+
+    // Owned by the emitter thread until it has been joined.
+    std::vector<std::string> Objects;
+    std::string Diagnostics;
+    bool EmitOk = true;
+
+    std::thread Worker; // last, so it starts once everything above exists
+
+    bool flush();
+    void run();
+    bool writeArchive(llvm::StringRef Filename);
+public:
+    explicit StreamingEmitter(CodeGenContext &Ctx)
+            : Ctx(Ctx), TM(createTargetMachine(llvm::nulls())), Worker([this] { run(); }) {
+        if (Ctx.Stats)
+            Ctx.Stats->Overlapped = true;
+    }
+    ~StreamingEmitter();
+
+    void definitionDone() {
+        if (++DefinitionsInModule >= StreamBatch)
+            FrontEndOk &= flush();
+    }
+    // Hands over the last batch, waits for the emitter and writes the archive.
+    bool finish(llvm::StringRef Filename);
+};
+
+} // end anonymous namespace
+
+// Queues the current module and gives the context a fresh one.
+bool StreamingEmitter::flush() {
+    DefinitionsInModule = 0;
+    if (!emitBatchEntryPoints(Ctx))
+        return false;
+
+    PendingModule Pending{std::move(Ctx.TheContext), std::move(Ctx.TheModule)};
+    Ctx.InitializeModuleAndPassManager();
+
+    std::unique_lock<std::mutex> Guard(Lock);
+    Changed.wait(Guard, [&] { return Queue.size() < MaxQueued; });
+    Queue.push_back(std::move(Pending));
+    Changed.notify_all();
+    return true;
+}
+
+void StreamingEmitter::run() {
+    llvm::raw_string_ostream Errs(Diagnostics);
+    while (true) {
+        PendingModule Pending;
+        {
+            std::unique_lock<std::mutex> Guard(Lock);
+            Changed.wait(Guard, [&] { return !Queue.empty() || Closed; });
+            if (Queue.empty())
+                return;
+            Pending = std::move(Queue.front());
+            Queue.pop_front();
+            Changed.notify_all();
+        }
+        // After a failure, keep draining so the parser never blocks.
+        if (!EmitOk)
+            continue;
+
+        optimizeModule(*Pending.Module, *TM, Ctx.OptLevel, Ctx.Stats);
+
+        int FD;
+        llvm::SmallString<128> Path;
+        if (auto EC = llvm::sys::fs::createTemporaryFile("toyc-stream", "o", FD, Path)) {
+            Errs << "Error: cannot create a temporary object: " << EC.message() << "\n";
+            EmitOk = false;
+            continue;
+        }
+        Objects.push_back(std::string(Path));
+
+        llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Emit));
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        EmitOk = writeModule(*Pending.Module, *TM, OS, Errs);
+    }
+}
+
+bool StreamingEmitter::writeArchive(llvm::StringRef Filename) {
+    llvm::TimeRegion Region(CompileStats::get(Ctx.Stats, &CompileStats::Emit));
+    std::vector<std::string> Names;
+    std::vector<llvm::NewArchiveMember> Members;
+    for (unsigned I = 0; I != Objects.size(); ++I)
+        Names.push_back(llvm::formatv("part{0}.o", I));
+    for (unsigned I = 0; I != Objects.size(); ++I) {
+        auto Member = llvm::NewArchiveMember::getFile(Objects[I], /*Deterministic=*/true);
+        if (!Member) {
+            llvm::logAllUnhandledErrors(Member.takeError(), Ctx.Errs, "Error: ");
+            return false;
+        }
+        Member->MemberName = Names[I];
+        Members.push_back(std::move(*Member));
+    }
+
+    // writeArchive streams the members from their files; only stdout needs
+    // the archive in memory.
+    auto Kind = getArchiveKind(*TM);
+    if (Filename == "-") {
+        auto Archive = llvm::writeArchiveToBuffer(Members, /*WriteSymtab=*/true, Kind,
+                                                  /*Deterministic=*/true, /*Thin=*/false);
+        if (!Archive) {
+            llvm::logAllUnhandledErrors(Archive.takeError(), Ctx.Errs, "Error: ");
+            return false;
+        }
+        llvm::outs() << (*Archive)->getBuffer();
+        return true;
+    }
+    if (auto Err = llvm::writeArchive(Filename, Members, /*WriteSymtab=*/true, Kind,
+                                      /*Deterministic=*/true, /*Thin=*/false)) {
+        llvm::logAllUnhandledErrors(std::move(Err), Ctx.Errs, "Error: ");
+        return false;
+    }
+    return true;
+}
+
+bool StreamingEmitter::finish(llvm::StringRef Filename) {
+    FrontEndOk &= flush();
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Closed = true;
+    }
+    Changed.notify_all();
+    Worker.join();
+
+    Ctx.Errs << Diagnostics;
+    return FrontEndOk && EmitOk && writeArchive(Filename);
+}
+
+StreamingEmitter::~StreamingEmitter() {
+    if (Worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Closed = true;
+        }
+        Changed.notify_all();
+        Worker.join();
+    }
+    for (const std::string &Object : Objects)
+        llvm::sys::fs::remove(Object);
+}
+
+//===----------------------------------------------------------------------===//
+// Embedding API
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+struct LazyDefinitions;
+
+// A definition of a lazily compiled module. Tier-0 code passes its address
+// to the tier-up hook.
+struct LazyDefinition {
+    LazyDefinitions *Defs;
+    FunctionAST *Fn;
+    bool TierUpQueued; // Under Defs->Lock.
+};
+
+// With Options::Lazy, parsed and type-checked definitions wait here until
+// they are first called. IR generation shares the arena, the prototypes and
+// TM, so it runs for one definition at a time; optimization and machine code
+// generation then run on the JIT's compile threads.
+struct LazyDefinitions {
+    ASTContext AST;
+    llvm::StringMap<PrototypeAST *> Protos;
+    llvm::StringMap<LazyDefinition> Definitions;
+    std::unique_ptr<llvm::TargetMachine> TM;
+    unsigned OptLevel = 2;
+    bool Speculate = false;
+    std::mutex Lock;
+    bool Closing = false;        // Set when the module is destroyed; under Lock.
+    llvm::StringSet<> Requested; // Definitions compiled or queued; under Lock.
+    unsigned Speculating = 0;    // Speculative lookups in flight; under Lock.
+    std::condition_variable SpeculationDone;
+    llvm::orc::LLJIT *JIT = nullptr;
+    // Holds the definitions themselves; the main JITDylib has a lazy
+    // call-through stub for each, and code in this one calls the stubs.
+    llvm::orc::JITDylib *ImplJD = nullptr;
+    llvm::orc::IndirectStubsManager *ISM = nullptr;
+
+    // With Options::Tiered, definitions start at -O0 behind a call counter.
+    // The TierUpCalls-th call queues the definition on TierUpThread, which
+    // regenerates it at -O3 with TierUpTM and points its stub at the result.
+    unsigned TierUpCalls = 0; // 0 when not tiered.
+    std::unique_ptr<llvm::TargetMachine> TierUpTM;
+    std::unique_ptr<llvm::ThreadPool> TierUpThread;
+};
+
+// One definition, generated when its stub is first called or it is
+// speculated. Generating it queues its callees on the compile threads, as
+// they are likely to be called next.
+class FunctionASTMaterializationUnit : public llvm::orc::MaterializationUnit {
+    LazyDefinitions &Defs;
+    LazyDefinition &Def;
+    FunctionAST &Fn;
+public:
+    FunctionASTMaterializationUnit(LazyDefinitions &Defs, LazyDefinition &Def)
+            : MaterializationUnit(Interface(
+                      llvm::orc::SymbolFlagsMap{{Defs.JIT->mangleAndIntern(Def.Fn->getProto()->getName()),
+                                                 llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable}},
+                      nullptr)),
+              Defs(Defs), Def(Def), Fn(*Def.Fn) {}
+
+    llvm::StringRef getName() const override { return Fn.getProto()->getName(); }
+
+private:
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override;
+    void discard(const llvm::orc::JITDylib &, const llvm::orc::SymbolStringPtr &) override {}
+};
+
+} // end anonymous namespace
+
+// Names Root calls directly, found by walking its CallExprASTs.
+static void collectCallees(ExprAST *Root, llvm::StringSet<> &Callees) {
+    llvm::SmallVector<ExprAST *, 32> Worklist{Root};
+    llvm::SmallVector<ExprAST *, 4> Ops;
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.pop_back_val();
+        if (auto *Call = llvm::dyn_cast<CallExprAST>(E))
+            Callees.insert(Call->getCallee());
+        Ops.clear();
+        getOperands(E, Ops);
+        Worklist.append(Ops.begin(), Ops.end());
+    }
+}
+
+// Gives Ctx the prototypes Fn's code can refer to, its own and its callees',
+// so generating one definition does not copy every prototype of the module.
+// Under Defs.Lock.
+static void addPrototypes(CodeGenContext &Ctx, const LazyDefinitions &Defs, FunctionAST &Fn,
+                          const llvm::StringSet<> &Callees) {
+    Ctx.FunctionProtos[Fn.getProto()->getName()] = Fn.getProto();
+    for (const auto &Callee : Callees)
+        if (PrototypeAST *Proto = Defs.Protos.lookup(Callee.getKey()))
+            Ctx.FunctionProtos[Callee.getKey()] = Proto;
+}
+
+// Regenerates a hot definition at -O3 for the host CPU, next to its tier-0
+// code, and swaps its stub over. The tier-0 code stays, as frames of it (a
+// recursion, say) may still be running.
+static void tierUp(LazyDefinition &Def) {
+    LazyDefinitions &Defs = *Def.Defs;
+    llvm::orc::LLJIT &JIT = *Defs.JIT;
+    llvm::orc::ExecutionSession &ES = JIT.getExecutionSession();
+    std::string Name = Def.Fn->getProto()->getName().str();
+    std::string Diagnostics;
+    llvm::raw_string_ostream Errs(Diagnostics);
+    std::unique_ptr<llvm::LLVMContext> Context;
+    std::unique_ptr<llvm::Module> M;
+    {
+        std::lock_guard<std::mutex> Lock(Defs.Lock);
+        if (Defs.Closing)
+            return;
+        CodeGenContext Ctx(*Defs.TierUpTM, Defs.AST, Errs, /*OptLevel=*/3);
+        llvm::StringSet<> Callees;
+        collectCallees(Def.Fn->getBody(), Callees);
+        addPrototypes(Ctx, Defs, *Def.Fn, Callees);
+        if (llvm::Function *F = Def.Fn->codegen(Ctx)) {
+            // Recursive calls now stay in the new code.
+            F->setName(Name + ".tier1");
+            M = std::move(Ctx.TheModule);
+            Context = std::move(Ctx.TheContext);
+        }
+    }
+    if (!M) {
+        ES.reportError(llvm::make_error<llvm::StringError>(llvm::StringRef(Errs.str()).rtrim(),
+                                                           llvm::inconvertibleErrorCode()));
+        return;
+    }
+
+    optimizeModule(*M, *Defs.TierUpTM, /*OptLevel=*/3, nullptr);
+    auto Object = llvm::orc::SimpleCompiler(*Defs.TierUpTM)(*M);
+    if (!Object)
+        return ES.reportError(Object.takeError());
+    if (llvm::Error Err = JIT.addObjectFile(*Defs.ImplJD, std::move(*Object)))
+        return ES.reportError(std::move(Err));
+    auto Symbol = JIT.lookup(*Defs.ImplJD, Name + ".tier1");
+    if (!Symbol)
+        return ES.reportError(Symbol.takeError());
+    if (llvm::Error Err = Defs.ISM->updatePointer(*JIT.mangleAndIntern(Name), Symbol->getAddress()))
+        return ES.reportError(std::move(Err));
+    ++NumTierUps;
+}
+
+// Called by tier-0 code on its TierUpCalls-th call.
+static void tierUpHook(LazyDefinition *Def) {
+    LazyDefinitions &Defs = *Def->Defs;
+    std::lock_guard<std::mutex> Lock(Defs.Lock);
+    // The counter wraps, so this can come again.
+    if (Defs.Closing || Def->TierUpQueued)
+        return;
+    Def->TierUpQueued = true;
+    Defs.TierUpThread->async([Def] { tierUp(*Def); });
+}
+
+// Counts F's calls at its entry and calls the tier-up hook for Def on the
+// TierUpCalls-th. The counter update is atomic, but not ordered with anything.
+static void addTierUpCounter(llvm::Function &F, LazyDefinition &Def, unsigned TierUpCalls) {
+    llvm::LLVMContext &C = F.getContext();
+    llvm::Type *CounterTy = llvm::Type::getInt32Ty(C);
+    auto *Counter = new llvm::GlobalVariable(*F.getParent(), CounterTy, /*isConstant=*/false,
+                                             llvm::GlobalValue::InternalLinkage,
+                                             llvm::ConstantInt::get(CounterTy, 0), F.getName() + ".calls");
+
+    // After the allocas, which have to stay in the entry block.
+    llvm::BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+    while (llvm::isa<llvm::AllocaInst>(IP))
+        ++IP;
+    llvm::IRBuilder<> Builder(&*IP);
+    llvm::Value *Calls = Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, Counter, Builder.getInt32(1),
+                                                 llvm::MaybeAlign(4), llvm::AtomicOrdering::Monotonic);
+    llvm::Value *Hot = Builder.CreateICmpEQ(Calls, Builder.getInt32(TierUpCalls - 1));
+    llvm::Instruction *Then = llvm::SplitBlockAndInsertIfThen(
+            Hot, &*IP, /*Unreachable=*/false, llvm::MDBuilder(C).createBranchWeights(1, TierUpCalls));
+
+    Builder.SetInsertPoint(Then);
+    auto *HookTy = llvm::FunctionType::get(Builder.getVoidTy(), {Builder.getInt8PtrTy()}, false);
+    auto *Hook = llvm::ConstantExpr::getIntToPtr(Builder.getInt64(llvm::pointerToJITTargetAddress(&tierUpHook)),
+                                                 HookTy->getPointerTo());
+    Builder.CreateCall(HookTy, Hook,
+                       {llvm::ConstantExpr::getIntToPtr(Builder.getInt64(llvm::pointerToJITTargetAddress(&Def)),
+                                                        Builder.getInt8PtrTy())});
+}
+
+void FunctionASTMaterializationUnit::materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) {
+    llvm::orc::ExecutionSession &ES = Defs.JIT->getExecutionSession();
+    std::string Diagnostics;
+    llvm::raw_string_ostream Errs(Diagnostics);
+    std::unique_ptr<llvm::LLVMContext> Context;
+    std::unique_ptr<llvm::Module> M;
+    llvm::orc::SymbolLookupSet Speculated;
+    {
+        std::lock_guard<std::mutex> Lock(Defs.Lock);
+        Defs.Requested.insert(Fn.getProto()->getName());
+        llvm::StringSet<> Callees;
+        collectCallees(Fn.getBody(), Callees);
+        if (Defs.Speculate && !Defs.Closing) {
+            for (const auto &Callee : Callees)
+                if (Defs.Definitions.count(Callee.getKey()) && Defs.Requested.insert(Callee.getKey()).second)
+                    Speculated.add(Defs.JIT->mangleAndIntern(Callee.getKey()));
+            if (!Speculated.empty())
+                ++Defs.Speculating;
+        }
+
+        CodeGenContext Ctx(*Defs.TM, Defs.AST, Errs, Defs.OptLevel);
+        addPrototypes(Ctx, Defs, Fn, Callees);
+        if (llvm::Function *F = Fn.codegen(Ctx)) {
+            if (Defs.TierUpCalls)
+                addTierUpCounter(*F, Def, Defs.TierUpCalls);
+            M = std::move(Ctx.TheModule);
+            Context = std::move(Ctx.TheContext);
+        }
+    }
+
+    if (!M) {
+        ES.reportError(llvm::make_error<llvm::StringError>(llvm::StringRef(Errs.str()).rtrim(),
+                                                           llvm::inconvertibleErrorCode()));
+        R->failMaterialization();
+        return;
+    }
+    ++NumLazyDefinitions;
+
+    // The lookup only starts the work; nobody waits for its result.
+    if (!Speculated.empty()) {
+        NumSpeculatedDefinitions += Speculated.size();
+        ES.lookup(llvm::orc::LookupKind::Static,
+                  {{Defs.ImplJD, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}}, std::move(Speculated),
+                  llvm::orc::SymbolState::Ready,
+                  [&Defs = Defs](llvm::Expected<llvm::orc::SymbolMap> Result) {
+                      llvm::consumeError(Result.takeError());
+                      std::lock_guard<std::mutex> Lock(Defs.Lock);
+                      if (--Defs.Speculating == 0)
+                          Defs.SpeculationDone.notify_all();
+                  },
+                  llvm::orc::NoDependenciesToRegister);
+    }
+
+    Defs.JIT->getIRTransformLayer().emit(std::move(R), llvm::orc::ThreadSafeModule(std::move(M), std::move(Context)));
+}
+
+// Every compiled module gets a JIT of its own, so modules can define the same
+// names, compile concurrently and be dropped independently. As in
+// LLLazyJIT, the stubs go before the JIT, so nothing may be compiling then.
+struct toyc::CompiledModule::Impl {
+    std::unique_ptr<LazyDefinitions> Lazy;
+    std::unique_ptr<llvm::orc::LLJIT> JIT;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> LCTM;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> ISM;
+    // Parameter types followed by the result type of every definition; empty
+    // for definitions with vector types.
+    llvm::StringMap<std::vector<ValueType>> Signatures;
+
+    ~Impl() {
+        // Lookups made by the caller have returned, but speculation and
+        // tier-ups may still be compiling; stop new ones and wait for them.
+        if (!Lazy)
+            return;
+        {
+            std::unique_lock<std::mutex> Lock(Lazy->Lock);
+            Lazy->Closing = true;
+            Lazy->SpeculationDone.wait(Lock, [&] { return Lazy->Speculating == 0; });
+        }
+        if (Lazy->TierUpThread)
+            Lazy->TierUpThread->wait();
+    }
+};
+
+toyc::CompiledModule::CompiledModule(std::unique_ptr<Impl> I) : I(std::move(I)) {}
+toyc::CompiledModule::CompiledModule(CompiledModule &&) = default;
+toyc::CompiledModule &toyc::CompiledModule::operator=(CompiledModule &&) = default;
+toyc::CompiledModule::~CompiledModule() = default;
+
+static llvm::Optional<toyc::ValueType> getValueType(llvm::Type *Ty) {
+    if (Ty->isIntegerTy(32))
+        return toyc::ValueType::I32;
+    if (Ty->isIntegerTy(64))
+        return toyc::ValueType::I64;
+    if (Ty->isFloatTy())
+        return toyc::ValueType::F32;
+    if (Ty->isDoubleTy())
+        return toyc::ValueType::F64;
+    return llvm::None;
+}
+
+// Parameter types followed by the result type, or nothing if any is a vector.
+static std::vector<toyc::ValueType> getSignature(llvm::FunctionType *FTy) {
+    std::vector<toyc::ValueType> Signature;
+    for (llvm::Type *Ty : FTy->params())
+        if (auto VT = getValueType(Ty))
+            Signature.push_back(*VT);
+    if (auto VT = getValueType(FTy->getReturnType()))
+        Signature.push_back(*VT);
+    if (Signature.size() != FTy->getNumParams() + 1)
+        Signature.clear();
+    return Signature;
+}
+
+static std::string formatSignature(llvm::ArrayRef<toyc::ValueType> Params, toyc::ValueType Result) {
+    static const char *const Names[] = {"i32", "i64", "f32", "f64"};
+    std::string Str = Names[(unsigned)Result];
+    Str += "(";
+    for (unsigned I = 0; I != Params.size(); ++I)
+        Str += (I ? ", " : "") + std::string(Names[(unsigned)Params[I]]);
+    return Str + ")";
+}
+
+llvm::Expected<uint64_t> toyc::CompiledModule::getAddress(llvm::StringRef Name) const {
+    auto Symbol = I->JIT->lookup(Name);
+    if (!Symbol)
+        return Symbol.takeError();
+    return Symbol->getAddress();
+}
+
+llvm::Expected<uint64_t> toyc::CompiledModule::getAddress(llvm::StringRef Name, llvm::ArrayRef<ValueType> Params,
+                                                          ValueType Result) const {
+    auto It = I->Signatures.find(Name);
+    if (It == I->Signatures.end())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "'%s' is not defined",
+                                       Name.str().c_str());
+    if (It->second.empty())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "'%s' has vector types; use getAddress", Name.str().c_str());
+
+    llvm::ArrayRef<ValueType> Actual = It->second;
+    if (Actual.drop_back() != Params || Actual.back() != Result)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "'%s' is %s, not %s",
+                                       Name.str().c_str(), formatSignature(Actual.drop_back(), Actual.back()).c_str(),
+                                       formatSignature(Params, Result).c_str());
+    return getAddress(Name);
+}
+
+// Generates and optimizes the whole source, then hands it to the JIT.
+static void compileEagerly(Lexer &Lex, llvm::TargetMachine &TM, unsigned OptLevel, llvm::orc::LLJIT &JIT,
+                           llvm::StringMap<std::vector<toyc::ValueType>> &Signatures, llvm::raw_ostream &Errs) {
+    ASTContext AST;
+    CodeGenContext Ctx(TM, AST, Errs, OptLevel);
+    Parser P(Lex, AST, Errs);
+    P.getNextToken();
+    MainLoop(P, Ctx, /*ShowPrompt=*/false);
+
+    for (llvm::Function &F : *Ctx.TheModule)
+        if (!F.isDeclaration())
+            Signatures[F.getName()] = getSignature(F.getFunctionType());
+    addModuleToJIT(Ctx, JIT, JIT.getMainJITDylib().getDefaultResourceTracker());
+}
+
+// Parses and type-checks the whole source, so that compile still reports
+// every error, but leaves the rest of the work to the materialization units.
+static void parseLazily(Lexer &Lex, LazyDefinitions &Defs, llvm::StringMap<std::vector<toyc::ValueType>> &Signatures,
+                        llvm::raw_ostream &Errs) {
+    Parser P(Lex, Defs.AST, Errs);
+    llvm::LLVMContext TypeContext; // Compares prototypes; nothing is generated in it.
+    auto Conflicts = [&](PrototypeAST *Previous, PrototypeAST *Proto) {
+        if (!Previous || Previous->getFunctionType(TypeContext) == Proto->getFunctionType(TypeContext))
+            return false;
+        Errs << "Error: Function redeclared with different parameter or result types\n";
+        return true;
+    };
+
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof) {
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                break;
+            case tok_def:
+                if (FunctionAST *Fn = P.ParseDefinition()) {
+                    PrototypeAST *Proto = Fn->getProto();
+                    PrototypeAST *Previous = Defs.Protos.lookup(Proto->getName());
+                    if (Defs.Definitions.count(Proto->getName())) {
+                        Errs << "Error: Function '" << Proto->getName() << "' is defined more than once\n";
+                        break;
+                    }
+                    Defs.Protos[Proto->getName()] = Proto;
+                    if (!TypeChecker(Defs.Protos, Errs).check(*Fn) || Conflicts(Previous, Proto)) {
+                        if (Previous)
+                            Defs.Protos[Proto->getName()] = Previous;
+                        else
+                            Defs.Protos.erase(Proto->getName());
+                        break;
+                    }
+                    Defs.Definitions[Proto->getName()] = {&Defs, Fn, false};
+                    Signatures[Proto->getName()] = getSignature(Proto->getFunctionType(TypeContext));
+                } else {
+                    P.getNextToken();
+                }
+                break;
+            case tok_extern:
+                if (PrototypeAST *Proto = P.ParseExtern()) {
+                    PrototypeAST *&Entry = Defs.Protos[Proto->getName()];
+                    if (!Conflicts(Entry, Proto) && !Entry)
+                        Entry = Proto;
+                } else {
+                    P.getNextToken();
+                }
+                break;
+            default:
+                // Checked like a definition, then dropped.
+                if (FunctionAST *Fn = P.ParseTopLevelExpr()) {
+                    Defs.Protos["__anon_expr"] = Fn->getProto();
+                    TypeChecker(Defs.Protos, Errs).check(*Fn);
+                    Defs.Protos.erase("__anon_expr");
+                } else {
+                    P.getNextToken();
+                }
+                break;
+        }
+    }
+}
+
+// Calls through a stub land here if their definition cannot be generated.
+static void reportLazyCompileFailure() {
+    llvm::report_fatal_error("toyc: a lazily compiled definition failed to compile");
+}
+
+// Defines every definition behind a lazy call-through stub in the main
+// JITDylib, so that none is generated before it is first called.
+static llvm::Error defineLazily(LazyDefinitions &Defs, llvm::orc::JITTargetMachineBuilder JTMB,
+                               std::unique_ptr<llvm::orc::LazyCallThroughManager> &LCTM,
+                               std::unique_ptr<llvm::orc::IndirectStubsManager> &ISM) {
+    llvm::orc::LLJIT &JIT = *Defs.JIT;
+    llvm::orc::ExecutionSession &ES = JIT.getExecutionSession();
+    const llvm::Triple &TT = JIT.getTargetTriple();
+
+    // Runs on whichever thread materializes the module, so each gets its own
+    // TargetMachine rather than sharing Defs.TM.
+    unsigned OptLevel = Defs.OptLevel;
+    JIT.getIRTransformLayer().setTransform(
+            [JTMB, OptLevel](llvm::orc::ThreadSafeModule TSM, llvm::orc::MaterializationResponsibility &)
+                    -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                auto Builder = JTMB;
+                auto TM = Builder.createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+                TSM.withModuleDo([&](llvm::Module &M) { optimizeModule(M, **TM, OptLevel, nullptr); });
+                return TSM;
+            });
+
+    auto CallThrough = llvm::orc::createLocalLazyCallThroughManager(
+            TT, ES, llvm::pointerToJITTargetAddress(&reportLazyCompileFailure));
+    if (!CallThrough)
+        return CallThrough.takeError();
+    LCTM = std::move(*CallThrough);
+    auto StubsBuilder = llvm::orc::createLocalIndirectStubsManagerBuilder(TT);
+    if (!StubsBuilder)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "no lazy call-through stubs for %s",
+                                       TT.str().c_str());
+    ISM = StubsBuilder();
+    Defs.ISM = ISM.get();
+
+    // The definitions see the main JITDylib first, so their calls go through
+    // the stubs too, and reach externs through its process symbol generator.
+    llvm::orc::JITDylib &MainJD = JIT.getMainJITDylib();
+    Defs.ImplJD = &ES.createBareJITDylib("<toyc lazy definitions>");
+    Defs.ImplJD->setLinkOrder({{&MainJD, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}},
+                              /*LinkAgainstThisJITDylibFirst=*/false);
+
+    llvm::orc::SymbolAliasMap Aliases;
+    for (auto &Entry : Defs.Definitions) {
+        if (llvm::Error Err = Defs.ImplJD->define(std::make_unique<FunctionASTMaterializationUnit>(Defs, Entry.second)))
+            return Err;
+        llvm::orc::SymbolStringPtr Name = JIT.mangleAndIntern(Entry.getKey());
+        Aliases[Name] = {Name, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
+    }
+    return MainJD.define(llvm::orc::lazyReexports(*LCTM, *ISM, *Defs.ImplJD, std::move(Aliases)));
+}
+
+llvm::Expected<toyc::CompiledModule> toyc::Compiler::compile(llvm::StringRef Source, const Options &Opts) {
+    static std::once_flag TargetsInitialized;
+    std::call_once(TargetsInitialized, [] {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+    });
+
+    // As InitializeJIT: an explicit CPU replaces the host's features.
+    auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+        return JTMB.takeError();
+    if (!Opts.CPU.empty()) {
+        JTMB->setCPU(Opts.CPU == "native" ? std::string(llvm::sys::getHostCPUName()) : Opts.CPU);
+        JTMB->getFeatures() = llvm::SubtargetFeatures();
+    }
+    for (const std::string &Feature : Opts.Features)
+        JTMB->getFeatures().AddFeature(Feature);
+    // Tier 0 is for starting quickly; tier 1 gets its own TargetMachine.
+    bool Lazy = Opts.Lazy || Opts.Tiered;
+    unsigned OptLevel = Opts.Tiered ? 0 : Opts.OptLevel;
+    JTMB->setCodeGenOptLevel(getCodeGenOptLevel(OptLevel));
+
+    auto TM = JTMB->createTargetMachine();
+    if (!TM)
+        return TM.takeError();
+    auto JIT = llvm::orc::LLJITBuilder()
+                       .setJITTargetMachineBuilder(*JTMB)
+                       .setNumCompileThreads(Lazy ? Opts.CompileThreads : 0)
+                       .create();
+    if (!JIT)
+        return JIT.takeError();
+    auto Generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            (*JIT)->getDataLayout().getGlobalPrefix());
+    if (!Generator)
+        return Generator.takeError();
+    (*JIT)->getMainJITDylib().addGenerator(std::move(*Generator));
+
+    // The front end reports problems only as text, so any diagnostic at all
+    // fails the compilation.
+    std::string Diagnostics;
+    llvm::raw_string_ostream Errs(Diagnostics);
+    Lexer Lex;
+    Lex.OpenBuffer(Source);
+    auto Result = std::make_unique<CompiledModule::Impl>();
+    Result->JIT = std::move(*JIT);
+    llvm::orc::LLJIT &J = *Result->JIT;
+
+    if (!Lazy) {
+        compileEagerly(Lex, **TM, OptLevel, J, Result->Signatures, Errs);
+    } else {
+        Result->Lazy = std::make_unique<LazyDefinitions>();
+        LazyDefinitions &Defs = *Result->Lazy;
+        Defs.TM = std::move(*TM);
+        Defs.OptLevel = OptLevel;
+        Defs.Speculate = Opts.CompileThreads > 0;
+        Defs.JIT = &J;
+        parseLazily(Lex, Defs, Result->Signatures, Errs);
+
+        if (Opts.Tiered) {
+            auto HostJTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+            if (!HostJTMB)
+                return HostJTMB.takeError();
+            HostJTMB->setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+            auto TierUpTM = HostJTMB->createTargetMachine();
+            if (!TierUpTM)
+                return TierUpTM.takeError();
+            Defs.TierUpCalls = std::max(Opts.TierUpCalls, 1u);
+            Defs.TierUpTM = std::move(*TierUpTM);
+            Defs.TierUpThread = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(1));
+        }
+    }
+    if (!Errs.str().empty())
+        return llvm::make_error<llvm::StringError>(llvm::StringRef(Diagnostics).rtrim(),
+                                                   llvm::inconvertibleErrorCode());
+    if (Lazy)
+        if (llvm::Error Err = defineLazily(*Result->Lazy, *JTMB, Result->LCTM, Result->ISM))
+            return Err;
+    return CompiledModule(std::move(Result));
+}
+
+//===----------------------------------------------------------------------===//
+// Driver
+//===----------------------------------------------------------------------===//
+
+// Folds one compilation's counters into the process totals, queues its
+// --stats-json-file record and prints its --time-report.
+static void reportCompileStats(CompileStats &Stats, uint64_t Tokens, uint64_t ASTNodes, llvm::raw_ostream &Errs) {
+    Stats.Tokens = Tokens;
+    Stats.ASTNodes = ASTNodes;
+    NumTokens += Stats.Tokens;
+    NumASTNodes += Stats.ASTNodes;
+    NumFunctions += Stats.Functions;
+    NumIRInstructions += Stats.IRInstructions;
+
+    if (!StatsJSON.empty()) {
+        std::lock_guard<std::mutex> Lock(FileStatsLock);
+        FileStats.push_back(Stats.toJSON());
+    }
+    // A TimerGroup that was never printed prints itself when destroyed.
+    if (TimeReport)
+        Stats.print(Errs);
+    else
+        Stats.Group.clear();
+}
+
+// Whether compileFile may take its output from, and give it to, the object
+// cache. Runs that print IR, tail-call reports or statistics always compile.
+static bool isOutputCacheable(const Lexer &Lex, llvm::StringRef OutputFile) {
+    return TheObjectCache && !Lex.isInteractive() && !UseJIT && OutputFile != "-" && !PrintIR &&
+           !ReportTailCalls && !TimeReport && StatsJSON.empty();
+}
+
+// Hashes the source with every option that shapes the output: the target,
+// the optimization level, --overflow, the output kind, partitioning,
+// batching, exports and the profile. Fails if the profile cannot be read.
+static bool computeOutputKey(llvm::StringRef Source, std::string &Key) {
+    llvm::SHA1 Hasher;
+    auto AddString = [&](llvm::StringRef Str) {
+        Hasher.update(std::to_string(Str.size()));
+        Hasher.update(":");
+        Hasher.update(Str);
+    };
+    auto AddInt = [&](uint64_t V) { AddString(std::to_string(V)); };
+
+    AddString("toyc-output-v1"); // Bump whenever the code generated for a node changes.
+    AddString(LLVM_VERSION_STRING);
+    AddString(llvm::sys::getDefaultTargetTriple());
+    AddString(getTargetMachineKey());
+    AddInt(Overflow);
+    AddInt(EmitLLVM);
+    AddInt(EmitAssembly);
+    AddInt(LTOMode);
+    AddInt(isSplitCodegen() ? CodegenPartitions : 1);
+    AddInt(StreamMode);
+    AddInt(StreamMode ? StreamBatch : 0);
+    AddInt(BatchFunctions.size());
+    for (const std::string &Name : BatchFunctions)
+        AddString(Name);
+    AddInt(ExportFunctions.size());
+    for (const std::string &Name : ExportFunctions)
+        AddString(Name);
+
+    AddInt(ProfileGenerate.getNumOccurrences());
+    AddString(ProfileGenerate);
+    if (!ProfileUse.empty()) {
+        auto Profile = llvm::MemoryBuffer::getFile(getPGOOptions()->ProfileFile);
+        if (!Profile)
+            return false;
+        AddString((*Profile)->getBuffer());
+    }
+
+    AddString(Source);
+    Key = llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+    return true;
+}
+
+// Writes the cached output for Key to OutputFile, leaving the file alone if it
+// already holds those bytes, and marks every --batch and --export name found,
+// as only outputs that define all of them are stored.
+static bool reuseCachedOutput(llvm::StringRef Key, llvm::StringRef OutputFile, llvm::raw_ostream &Errs) {
+    auto Cached = TheObjectCache->lookup(Key, getOutputExtension());
+    if (!Cached)
+        return false;
+
+    auto Existing = llvm::MemoryBuffer::getFile(OutputFile, /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+    if (!Existing || (*Existing)->getBuffer() != Cached->getBuffer()) {
+        llvm::SmallString<128> TempModel(OutputFile);
+        TempModel += "-%%%%%%%%.tmp";
+        if (llvm::Error Err = llvm::writeFileAtomically(TempModel, OutputFile, Cached->getBuffer())) {
+            llvm::logAllUnhandledErrors(std::move(Err), Errs, "Warning: could not copy cached output: ");
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(BatchFoundLock);
+        for (const std::string &Name : BatchFunctions)
+            BatchFound.insert(Name);
+    }
+    std::lock_guard<std::mutex> Lock(ExportFoundLock);
+    for (const std::string &Name : ExportFunctions)
+        ExportFound.insert(Name);
+    return true;
+}
+
+static void storeCachedOutput(llvm::StringRef Key, llvm::StringRef OutputFile, llvm::raw_ostream &Errs) {
+    auto Output = llvm::MemoryBuffer::getFile(OutputFile, /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false);
+    if (Output)
+        TheObjectCache->store(Key, getOutputExtension(), (*Output)->getBuffer(), Errs);
+}
+
+// Compiles one translation unit from start to finish. Nothing here touches
+// shared state, so any number of these can run concurrently.
+static bool compileFile(llvm::StringRef InputFile, llvm::StringRef OutputFile, llvm::raw_ostream &Errs){
+    Lexer Lex;
+    if (InputFile == "-" && llvm::sys::Process::StandardInIsUserInput())
+        Lex.OpenInteractiveSource();
+    else if (!Lex.OpenSource(InputFile, Errs))
+        return false;
+
+    // An unchanged input built with the same options is not compiled again.
+    std::string OutputKey;
+    if (isOutputCacheable(Lex, OutputFile) && computeOutputKey(Lex.getBuffer(), OutputKey) &&
+        reuseCachedOutput(OutputKey, OutputFile, Errs))
+        return true;
+    // Outputs of compilations that reported anything are not stored, since a
+    // hit would not repeat the report.
+    uint64_t ErrsStart = Errs.tell();
+
+    std::unique_ptr<CompileStats> Stats;
+    if (TimeReport || !StatsJSON.empty()) {
+        Stats = std::make_unique<CompileStats>(InputFile);
+        if (!Lex.isInteractive()) {
+            llvm::TimeRegion Region(Stats->Lex);
+            Lexer Scan;
+            Scan.OpenBuffer(Lex.getBuffer());
+            while (Scan.getok() != tok_eof)
+                ;
+        }
+    }
+
+    std::unique_ptr<llvm::TargetMachine> TM = UseJIT ? nullptr : acquireTargetMachine(Errs);
+    if (!UseJIT && !TM)
+        return false;
+    // Declared before the contexts below, so it runs after they are gone.
+    auto ReleaseTM = llvm::make_scope_exit([&] { releaseTargetMachine(std::move(TM)); });
+    llvm::TargetMachine &CodeGenTM = UseJIT ? *JITTargetMachine : *TM;
+
+    // The arenas are declared first so they outlive everything that points
+    // into them, and are released in one go once the object has been written.
+    ASTContext AST;
+    std::vector<std::unique_ptr<ParsedChunk>> Chunks;
+    CodeGenContext Ctx(CodeGenTM, AST, Errs);
+    Parser P(Lex, AST, Errs);
+    Ctx.Stats = Stats.get();
+    Ctx.NoSignedWrap = Overflow == Overflow_Undefined;
+
+    bool ShowPrompt = Lex.isInteractive();
+    if (ShowPrompt)
+        Errs << "ready> ";
+    bool Parsed = !ShowPrompt && ParseThreads != 1 && parseInParallel(Lex.getBuffer(), Chunks, Stats.get());
+    if (!Parsed)
+        P.getNextToken();
+
+    // Declared after Ctx, so the emitter thread is joined before the context
+    // it reads goes away.
+    std::unique_ptr<StreamingEmitter> Stream;
+    if (StreamMode)
+        Stream = std::make_unique<StreamingEmitter>(Ctx);
+
+    auto OnDefinition = [&] {
+        if (Stream)
+            Stream->definitionDone();
+    };
+    if (Parsed)
+        generateParsedItems(Chunks, Ctx, OnDefinition);
+    else
+        MainLoop(P, Ctx, ShowPrompt, OnDefinition);
+
+    bool Ok = UseJIT || (Stream ? Stream->finish(OutputFile) : compileToFile(Ctx, OutputFile));
+    if (Ok && !OutputKey.empty() && Errs.tell() == ErrsStart &&
+        Ctx.RequestedFound == BatchFunctions.size() + ExportFunctions.size())
+        storeCachedOutput(OutputKey, OutputFile, Errs);
+    if (Stats) {
+        uint64_t Tokens = Lex.getTokenCount(), ASTNodes = AST.getNodeCount();
+        for (const auto &Chunk : Chunks) {
+            Tokens += Chunk->Lex.getTokenCount();
+            ASTNodes += Chunk->AST.getNodeCount();
+        }
+        reportCompileStats(*Stats, Tokens, ASTNodes, Errs);
+    }
+    return Ok;
+}
+
+// With several inputs each file gets its own output next to it (foo.toy ->
+// foo.o, or foo.bc/.ll/.s), and the files are compiled on a thread pool.
+static bool compileFiles(llvm::ArrayRef<std::string> Inputs, llvm::raw_ostream &Out,
+                         llvm::raw_ostream &Errs){
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(Threads));
+    std::mutex OutputLock;
+    std::atomic<bool> Failed(false);
+
+    for (const std::string &Input : Inputs) {
+        Pool.async([&, Input] {
+            llvm::SmallString<128> Output(Input);
+            llvm::sys::path::replace_extension(Output, getOutputExtension());
+
+            // Buffer diagnostics so files do not interleave on stderr.
+            std::string Diagnostics;
+            llvm::raw_string_ostream FileErrs(Diagnostics);
+            bool Ok = compileFile(Input, Output, FileErrs);
+            FileErrs.flush();
+
+            std::lock_guard<std::mutex> Lock(OutputLock);
+            Errs << Diagnostics;
+            if (Ok)
+                Out << "Wrote " << Output << "\n";
+            else
+                Failed = true;
+        });
+    }
+
+    Pool.wait();
+    return !Failed;
+}
+
+//===----------------------------------------------------------------------===//
+// Compile Server
+//===----------------------------------------------------------------------===//
+
+// toyc --server=<socket> keeps the registered targets, pooled TargetMachines
+// and a resident function cache between compilations, so a build that runs
+// toyc-client per file skips process startup and target setup. Both ends run
+// on one machine, so every value on the wire is a native uint32_t, and every
+// string is its uint32_t length followed by its bytes:
+//
+//   request: string count, working directory, arguments...
+//   reply:   exit status, stdout, stderr
+//
+// Options are global, so requests are served one at a time, each starting
+// from the defaults plus its own arguments. Several inputs in one request are
+// still compiled in parallel.
+
+static int runCompiler(const char *Argv0, llvm::raw_ostream &Out, llvm::raw_ostream &Errs);
+
+#ifdef LLVM_ON_UNIX
+// Bounds a request, so a stray client cannot make the server allocate freely.
+static constexpr uint32_t MaxRequestStrings = 1 << 16;
+static constexpr uint32_t MaxRequestString = 1 << 20;
+
+static bool readFull(int FD, void *Buf, size_t Size) {
+    char *Ptr = static_cast<char *>(Buf);
+    while (Size) {
+        ssize_t N = ::read(FD, Ptr, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Ptr += N;
+        Size -= N;
+    }
+    return true;
+}
+
+static bool writeFull(int FD, const void *Buf, size_t Size) {
+    const char *Ptr = static_cast<const char *>(Buf);
+    while (Size) {
+        ssize_t N = ::write(FD, Ptr, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Ptr += N;
+        Size -= N;
+    }
+    return true;
+}
+
+static bool readString(int FD, std::string &Str) {
+    uint32_t Size;
+    if (!readFull(FD, &Size, sizeof(Size)) || Size > MaxRequestString)
+        return false;
+    Str.resize(Size);
+    return readFull(FD, &Str[0], Size);
+}
+
+static bool writeString(int FD, llvm::StringRef Str) {
+    uint32_t Size = Str.size();
+    return writeFull(FD, &Size, sizeof(Size)) && writeFull(FD, Str.data(), Size);
+}
+
+// Runs one request's command line as if toyc had been started with it.
+static int runRequest(const char *Argv0, llvm::ArrayRef<std::string> Request, llvm::raw_ostream &Out,
+                      llvm::raw_ostream &Errs) {
+    if (std::error_code EC = llvm::sys::fs::set_current_path(Request.front())) {
+        Errs << "Error: could not enter '" << Request.front() << "': " << EC.message() << "\n";
+        return 1;
+    }
+
+    std::vector<const char *> Argv{Argv0};
+    for (const std::string &Arg : Request.drop_front()) {
+        // These print to the server's own stdout and exit.
+        llvm::StringRef Name = llvm::StringRef(Arg).ltrim('-');
+        if (Name.startswith("help") || Name == "version" || Name == "print-options" ||
+            Name == "print-all-options") {
+            Errs << Argv0 << ": run toyc directly for " << Arg << "\n";
+            return 1;
+        }
+        Argv.push_back(Arg.c_str());
+    }
+
+    llvm::cl::ResetAllOptionOccurrences();
+    if (!llvm::cl::ParseCommandLineOptions(Argv.size(), Argv.data(), "ToyC compiler\n", &Errs))
+        return 1;
+
+    if (UseJIT || !ServerSocket.empty()) {
+        Errs << Argv0 << ": --jit and --server cannot be used through the server\n";
+        return 1;
+    }
+    if (InputFilenames.empty() || llvm::is_contained(InputFilenames, "-") || OutputFilename == "-") {
+        Errs << Argv0 << ": the server cannot use standard input or output; name the input files\n";
+        return 1;
+    }
+
+    FileStats.clear();
+    BatchFound.clear();
+    ExportFound.clear();
+    llvm::ResetStatistics();
+    return runCompiler(Argv0, Out, Errs);
+}
+
+static void serveConnection(int Conn, const char *Argv0) {
+    uint32_t Count;
+    if (!readFull(Conn, &Count, sizeof(Count)) || Count == 0 || Count > MaxRequestStrings)
+        return;
+    std::vector<std::string> Request(Count);
+    for (std::string &Str : Request)
+        if (!readString(Conn, Str))
+            return;
+
+    std::string Output, Diagnostics;
+    llvm::raw_string_ostream Out(Output), Errs(Diagnostics);
+    uint32_t Status = runRequest(Argv0, Request, Out, Errs);
+    Out.flush();
+    Errs.flush();
+
+    // A client that has gone away just misses its reply.
+    if (writeFull(Conn, &Status, sizeof(Status)) && writeString(Conn, Output))
+        writeString(Conn, Diagnostics);
+}
+#endif
+
+static int runServer(const char *Argv0, const std::string &SocketPath) {
+#ifdef LLVM_ON_UNIX
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+        llvm::errs() << Argv0 << ": socket path '" << SocketPath << "' is too long\n";
+        return 1;
+    }
+    std::copy(SocketPath.begin(), SocketPath.end(), Addr.sun_path);
+
+    // Replace a socket left behind by a server that died, but never a live
+    // server's socket or a file that is not a socket at all.
+    llvm::sys::fs::file_status Existing;
+    if (!llvm::sys::fs::status(SocketPath, Existing)) {
+        int Probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        bool Live = Probe >= 0 && ::connect(Probe, (sockaddr *)&Addr, sizeof(Addr)) == 0;
+        if (Probe >= 0)
+            ::close(Probe);
+        if (Live || Existing.type() != llvm::sys::fs::file_type::socket_file) {
+            llvm::errs() << Argv0 << ": '" << SocketPath << "' is "
+                         << (Live ? "already being served" : "not a socket") << "\n";
+            return 1;
+        }
+        ::unlink(SocketPath.c_str());
+    }
+
+    int Listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0 || ::bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) != 0 ||
+        ::listen(Listener, SOMAXCONN) != 0) {
+        llvm::errs() << Argv0 << ": cannot listen on '" << SocketPath << "': " << llvm::sys::StrError() << "\n";
+        return 1;
+    }
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // Requests may name any target, so register them all once.
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmPrinters();
+    llvm::InitializeAllAsmParsers();
+    Resident = true;
+    TheTargetMachinePool = std::make_unique<TargetMachinePool>();
+
+    llvm::outs() << "Listening on " << SocketPath << "\n";
+    llvm::outs().flush();
+    for (;;) {
+        int Conn = ::accept(Listener, nullptr, nullptr);
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            llvm::errs() << Argv0 << ": accept failed: " << llvm::sys::StrError() << "\n";
+            return 1;
+        }
+        serveConnection(Conn, Argv0);
+        ::close(Conn);
+    }
+#else
+    llvm::errs() << Argv0 << ": --server needs Unix domain sockets\n";
+    return 1;
+#endif
+}
+
+//===----------------------------------------------------------------------===//
+// Main
+//===----------------------------------------------------------------------===//
+
+// Everything after option parsing, for one command line: checks the option
+// combinations, compiles and reports.
+static int runCompiler(const char *Argv0, llvm::raw_ostream &Out, llvm::raw_ostream &Errs) {
+    if (OptLevel < '0' || OptLevel > '3') {
+        Errs << Argv0 << ": invalid optimization level -O" << OptLevel << "\n";
+        return 1;
+    }
+
+    if (UseJIT && InputFilenames.size() > 1) {
+        Errs << Argv0 << ": --jit takes at most one input file\n";
+        return 1;
+    }
+
+    bool UsePGO = ProfileGenerate.getNumOccurrences() || !ProfileUse.empty();
+    if (UseJIT && (EmitLLVM || EmitAssembly || LTOMode != LTO_None || CodegenPartitions > 1 ||
+                   StreamMode || UsePGO || !OutputFilename.empty() || !BatchFunctions.empty())) {
+        Errs << Argv0 << ": --emit-llvm, -S, -flto, -j, --stream, -fprofile-generate, "
+                                   "-fprofile-use, -o and --batch cannot be used with --jit\n";
+        return 1;
+    }
+
+    if (ProfileGenerate.getNumOccurrences() && !ProfileUse.empty()) {
+        Errs << Argv0 << ": -fprofile-generate and -fprofile-use are mutually exclusive\n";
+        return 1;
+    }
+
+    // A missing profile is fatal inside the pipeline; report it here instead.
+    if (!ProfileUse.empty() && !llvm::sys::fs::exists(getPGOOptions()->ProfileFile)) {
+        Errs << Argv0 << ": cannot find profile '" << getPGOOptions()->ProfileFile << "'\n";
+        return 1;
+    }
+
+    if (StreamMode && (EmitLLVM || EmitAssembly || CodegenPartitions > 1)) {
+        Errs << Argv0 << ": --stream writes an archive and cannot be combined with "
+                                   "--emit-llvm, -S or -j\n";
+        return 1;
+    }
+
+    // Later batches call earlier ones, so nothing in a stream can be internal.
+    if (!ExportFunctions.empty() && (StreamMode || UseJIT)) {
+        Errs << Argv0 << ": --export cannot be used with --stream or --jit\n";
+        return 1;
+    }
+
+    if (!OutputFilename.empty() && InputFilenames.size() > 1) {
+        Errs << Argv0 << ": -o cannot be used with multiple input files\n";
+        return 1;
+    }
+
+    // Statistics only register, and so only show up in reports, once enabled.
+    if (TimeReport || !StatsJSON.empty())
+        llvm::EnableStatistics(/*DoPrintOnExit=*/false);
+
+    InitializeTargets();
+
+    // A resident cache is kept while requests keep naming the same directory.
+    llvm::SmallString<128> AbsoluteCacheDir(CacheDir);
+    if (!CacheDir.empty())
+        llvm::sys::fs::make_absolute(AbsoluteCacheDir);
+    if (CacheDir.empty()) {
+        TheFunctionCache.reset();
+        TheObjectCache.reset();
+    } else if (TheFunctionCache && TheFunctionCache->getDir() == AbsoluteCacheDir) {
+        TheFunctionCache->resetCounters();
+        TheObjectCache->resetCounters();
+    } else {
+        TheFunctionCache = std::make_unique<FunctionCache>(AbsoluteCacheDir, Resident);
+        if (!TheFunctionCache->initialize(Errs)) {
+            TheFunctionCache.reset();
+            TheObjectCache.reset();
+            return 1;
+        }
+        TheObjectCache = std::make_unique<ObjectFileCache>(AbsoluteCacheDir);
+    }
+
+    // After the caches, so the JIT can load objects from this one.
+    if (UseJIT && !InitializeJIT())
+        return 1;
+
+    // Report a bad target once up front rather than once per file.
+    if (!UseJIT) {
+        std::unique_ptr<llvm::TargetMachine> TM = acquireTargetMachine(Errs);
+        if (!TM)
+            return 1;
+        releaseTargetMachine(std::move(TM));
+    }
+
+    bool Ok;
+    if (InputFilenames.size() > 1) {
+        Ok = compileFiles(InputFilenames, Out, Errs);
+    } else {
+        std::string Input = InputFilenames.empty() ? "-" : InputFilenames.front();
+        std::string Output = OutputFilename.empty() ? std::string("output.") + getOutputExtension()
+                                                    : OutputFilename.getValue();
+        Ok = compileFile(Input, Output, Errs);
+        if (Ok && !UseJIT && Output != "-")
+            Out << "Wrote " << Output << "\n";
+    }
+
+    for (const std::string &Name : BatchFunctions) {
+        if (Ok && !BatchFound.count(Name)) {
+            Errs << "Error: --batch function '" << Name << "' is not defined\n";
+            Ok = false;
+        }
+    }
+
+    for (const std::string &Name : ExportFunctions) {
+        if (Ok && !ExportFound.count(Name)) {
+            Errs << "Error: --export function '" << Name << "' is not defined\n";
+            Ok = false;
+        }
+    }
+
+    if (TheFunctionCache) {
+        Errs << "Function cache: " << TheFunctionCache->getHits() << " hits, "
+                     << TheFunctionCache->getMisses() << " misses\n";
+        Errs << "Object cache: " << TheObjectCache->getHits() << " hits, "
+                     << TheObjectCache->getMisses() << " misses\n";
+    }
+
+    if (TimeReport) {
+        llvm::PrintStatistics(Errs);
+        Errs << "Peak RSS: " << llvm::format("%.1f", getPeakRSSBytes() / (1024.0 * 1024.0))
+                     << " MiB\n";
+    }
+    if (!StatsJSON.empty() && !writeStatsJSON(StatsJSON, Errs))
+        return 1;
+
+    return Ok ? 0 : 1;
+}
+
+int toyc::driverMain(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "ToyC compiler\n");
+    if (!ServerSocket.empty())
+        return runServer(argv[0], ServerSocket);
+    return runCompiler(argv[0], llvm::outs(), llvm::errs());
+}
@@ -0,0 +1,91 @@
+//
+// Tests of the embedding API: compiles with toyc::Compiler::compile and calls
+// the results, eagerly, lazily and tiered.
+//
+// Build: cmake --build build --target toyc-compiler-test
+// Run:   ctest --test-dir build (or ./toyc-compiler-test)
+//
+
+#include "toyc/Compiler.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <thread>
+
+namespace {
+
+// fib calls itself and helper calls another definition, so generating either
+// needs prototypes besides its own.
+const char *Source = "def fib(n) if n < 2 then n else fib(n-1) + fib(n-2)\n"
+                     "def twice(x) x * 2\n"
+                     "def helper(x) twice(x) + 1\n"
+                     "def unused(x) x\n";
+
+// The library's count of definitions recompiled at -O3.
+uint64_t getTierUps() {
+    for (const auto &Stat : llvm::GetStatistics())
+        if (Stat.first == "NumTierUps")
+            return Stat.second;
+    return 0;
+}
+
+bool callAll(int (*Fib)(int), int (*Helper)(int)) {
+    bool Ok = true;
+    for (int I = 0; I != 20000; ++I)
+        Ok &= Fib(15) == 610 && Helper(I) == 2 * I + 1;
+    return Ok;
+}
+
+bool check(const char *Name, const toyc::Options &Opts) {
+    uint64_t TierUpsBefore = getTierUps();
+    auto Module = toyc::Compiler::compile(Source, Opts);
+    if (!Module) {
+        llvm::errs() << "FAIL " << Name << ": " << llvm::toString(Module.takeError()) << "\n";
+        return false;
+    }
+    auto Fib = Module->lookup<int(int)>("fib");
+    auto Helper = Module->lookup<int(int)>("helper");
+    if (!Fib || !Helper) {
+        llvm::errs() << "FAIL " << Name << ": "
+                     << llvm::toString(llvm::joinErrors(Fib.takeError(), Helper.takeError())) << "\n";
+        return false;
+    }
+
+    // Far more calls than TierUpCalls. With Tiered, wait for the -O3 code
+    // and call again: the pointers from lookup go through the stubs, so they
+    // reach the new code.
+    bool Ok = callAll(*Fib, *Helper);
+    if (Opts.Tiered) {
+        auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (getTierUps() < TierUpsBefore + 2 && std::chrono::steady_clock::now() < Deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (getTierUps() < TierUpsBefore + 2) {
+            llvm::errs() << "FAIL " << Name << ": fib and helper were not recompiled\n";
+            return false;
+        }
+        Ok &= callAll(*Fib, *Helper);
+    }
+    llvm::errs() << (Ok ? "PASS " : "FAIL ") << Name << "\n";
+    return Ok;
+}
+
+} // end anonymous namespace
+
+int main() {
+    // Statistics are only listed by GetStatistics once enabled.
+    llvm::EnableStatistics(/*DoPrintOnExit=*/false);
+    toyc::Options Eager;
+    toyc::Options Lazy;
+    Lazy.Lazy = true;
+    toyc::Options Speculating = Lazy;
+    Speculating.CompileThreads = 2;
+    toyc::Options Tiered;
+    Tiered.Tiered = true;
+    Tiered.TierUpCalls = 10;
+
+    bool Ok = check("eager", Eager);
+    Ok &= check("lazy", Lazy);
+    Ok &= check("lazy-speculating", Speculating);
+    Ok &= check("tiered", Tiered);
+    return Ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+//
+// Regression test for inputs nested far deeper than the call stack could
+// follow if the parser or code generator recursed per level. Each case is
+// generated, run with `toyc --jit` at -O0 and -O2, and must print the
+// expected result instead of crashing.
+//
+// Build: cmake --build build --target toyc-deep-nesting-test
+// Run:   ctest --test-dir build (or ./toyc-deep-nesting-test)
+//
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdio>
+#include <string>
+
+namespace {
+
+// Deep enough to overflow an 8 MB stack at a few frames per level.
+constexpr unsigned Depth = 100000;
+// Terms in an x+x+... chain; the parser builds it left-nested, one level per term.
+constexpr unsigned ChainLength = 200000;
+
+void repeat(llvm::raw_ostream &OS, llvm::StringRef Str, unsigned N) {
+    for (unsigned I = 0; I != N; ++I)
+        OS << Str;
+}
+
+// def f(x) ((((x)))), with Depth parentheses.
+void generateParens(llvm::raw_ostream &OS) {
+    OS << "def f(x) ";
+    repeat(OS, "(", Depth);
+    OS << "x";
+    repeat(OS, ")", Depth);
+    OS << "\nf(5)\n";
+}
+
+// def f(x) x-(x-(x-...)), right-nested, with Depth operands: 0 for x = 1.
+void generateRightNested(llvm::raw_ostream &OS) {
+    OS << "def f(x) ";
+    repeat(OS, "x-(", Depth - 1);
+    OS << "x";
+    repeat(OS, ")", Depth - 1);
+    OS << "\nf(1)\n";
+}
+
+void generateChain(llvm::raw_ostream &OS) {
+    OS << "x";
+    repeat(OS, "+x", ChainLength - 1);
+}
+
+// A loop whose body is a long chain: def f(x) for i = 0, i < x in x+x+...
+void generateForBody(llvm::raw_ostream &OS) {
+    OS << "def f(x) for i = 0, i < x in ";
+    generateChain(OS);
+    OS << "\nf(3)\n";
+}
+
+// An arm that is a long chain: def f(x) if x < 1 then 0 else x+x+...
+void generateIfArm(llvm::raw_ostream &OS) {
+    OS << "def f(x) if x < 1 then 0 else ";
+    generateChain(OS);
+    OS << "\nf(1)\n";
+}
+
+// A chain whose innermost operand is an if: def f(x) (if x < 1 then 0 else x)+x+...
+void generateIfInChain(llvm::raw_ostream &OS) {
+    OS << "def f(x) (if x < 1 then 0 else x)";
+    repeat(OS, "+x", ChainLength - 1);
+    OS << "\nf(1)\n";
+}
+
+struct Case {
+    const char *Name;
+    void (*Generate)(llvm::raw_ostream &);
+    const char *Expected; // The line --jit must print.
+};
+
+const Case Cases[] = {
+        {"parens", generateParens, "Evaluated to 5"},
+        {"right-nested", generateRightNested, "Evaluated to 0"},
+        {"for-body", generateForBody, "Evaluated to 0"},
+        {"if-arm", generateIfArm, "Evaluated to 200000"},
+        {"if-in-chain", generateIfInChain, "Evaluated to 200000"},
+};
+
+bool runCase(const Case &C, llvm::StringRef OptLevel) {
+    llvm::SmallString<128> Source, Output;
+    int FD;
+    if (llvm::sys::fs::createTemporaryFile("toyc-deep", "toy", FD, Source) ||
+        llvm::sys::fs::createTemporaryFile("toyc-deep", "out", Output)) {
+        std::fprintf(stderr, "error: cannot create temporary files\n");
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        C.Generate(OS);
+    }
+
+    llvm::StringRef Args[] = {TOYC_PATH, "--jit", OptLevel, Source};
+    llvm::Optional<llvm::StringRef> Redirects[] = {llvm::None, llvm::StringRef(Output), llvm::None};
+    std::string Error;
+    int Status = llvm::sys::ExecuteAndWait(TOYC_PATH, Args, llvm::None, Redirects, 0, 0, &Error);
+
+    auto Buffer = llvm::MemoryBuffer::getFile(Output);
+    llvm::sys::fs::remove(Source);
+    llvm::sys::fs::remove(Output);
+    bool Ok = Status == 0 && Buffer && (*Buffer)->getBuffer().contains(C.Expected);
+    std::fprintf(stderr, "%s %s %s\n", Ok ? "PASS" : "FAIL", C.Name, OptLevel.str().c_str());
+    if (!Ok)
+        std::fprintf(stderr, "  exit status %d %s\n", Status, Error.c_str());
+    return Ok;
+}
+
+} // end anonymous namespace
+
+int main() {
+    bool Ok = true;
+    for (const Case &C : Cases)
+        for (llvm::StringRef OptLevel : {"-O0", "-O2"})
+            Ok &= runCase(C, OptLevel);
+    return Ok ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+//
+// End-to-end tests of toyc's options. Each case compiles a small program and
+// checks what toyc printed (`--jit` results) or wrote (`-S --emit-llvm`) for
+// text that must appear, in order, or must not appear at all.
+//
+// Build: cmake --build build --target toyc-test
+// Run:   ctest --test-dir build (or ./toyc-test)
+//
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+
+namespace {
+
+struct Case {
+    const char *Name;
+    std::initializer_list<const char *> Args; // Passed before the source file.
+    const char *Source;
+    std::initializer_list<const char *> Expected;   // Must appear in this order.
+    std::initializer_list<const char *> Unexpected; // Must not.
+    // With -S --emit-llvm the IR written to a temporary -o file is checked,
+    // otherwise what toyc prints on stdout.
+    bool EmitsIR = false;
+    // The program must die on a trap (llvm.trap is ud2 on x86) instead of
+    // exiting; output is not checked, as stdout may not have been flushed.
+    bool Traps = false;
+};
+
+const Case Cases[] = {
+        // Every --batch wrapper stays external next to its --export function.
+        {"batch-export",
+         {"-O2", "--batch=a,b", "--export=a,b", "-S", "--emit-llvm"},
+         "def a(x) x*2\ndef b(x) x+1\ndef c(x) x\n",
+         {"define i32 @a(", "define i32 @b(", "@a_batch(", "@b_batch("},
+         {"define internal void @a_batch", "define internal void @b_batch"},
+         /*EmitsIR=*/true},
+
+        // The simplifier folds constants the way codegen evaluates them, and
+        // leaves the floating-point identities that do not hold for -0.0 and
+        // NaN: x+0 gives +0 for -0, and x*0 and x-x give NaN for NaN and inf.
+        {"fold-constants",
+         {"--jit", "-O2"},
+         "7 / 2 + 7 % 3\n"
+         "(2147483647 + 1) * 2\n"
+         "def neg0():f64 0.0 * (0.0 - 1.0)\n"
+         "neg0()\n"
+         "def addzero(x:f64):f64 x + 0.0\n"
+         "addzero(neg0())\n"
+         "def mulzero(x:f64):f64 x * 0.0\n"
+         "mulzero(sqrt(0.0 - 1.0))\n"
+         "def subself(x:f64):f64 x - x\n"
+         "subself(1.0 / 0.0)\n",
+         {"Evaluated to 4\n", "Evaluated to 0\n", "Evaluated to -0.000000\n", "Evaluated to 0.000000\n",
+          "nan\n", "nan\n"},
+         {}},
+        // Hash-consed subtrees are generated once per dominating scope: the
+        // then arm's x*3+1 must not be reused in the else arm.
+        {"hash-consing",
+         {"--jit", "-O2"},
+         "def sq(x) (x*x+1) * (x*x+1)\n"
+         "sq(3)\n"
+         "def arms(x) if x < 1 then x*3+1 else (x*3+1) + (x*3+1)\n"
+         "arms(0)\n"
+         "arms(2)\n"
+         "def loop(x) for i = 0, i < x*2+1 in x*2+1\n"
+         "loop(2)\n",
+         {"Evaluated to 100\n", "Evaluated to 1\n", "Evaluated to 14\n", "Evaluated to 0\n"},
+         {}},
+
+        // INT_MIN / -1 wraps instead of faulting, shift amounts are taken
+        // modulo the width and >> is arithmetic, and constant folding agrees
+        // with the generated code.
+        {"arithmetic",
+         {"--jit", "-O2"},
+         "def div(x y) x / y\n"
+         "def rem(x y) x % y\n"
+         "div(0 - 2147483647 - 1, 0 - 1)\n"
+         "rem(0 - 2147483647 - 1, 0 - 1)\n"
+         "div(0 - 7, 2)\n"
+         "rem(0 - 7, 2)\n"
+         "def shl(x n) x << n\n"
+         "def shr(x n) x >> n\n"
+         "shl(1, 33)\n"
+         "shr(0 - 8, 1)\n"
+         "1 << 33\n"
+         "(0 - 8) >> 33\n",
+         {"Evaluated to -2147483648\n", "Evaluated to 0\n", "Evaluated to -3\n", "Evaluated to -1\n",
+          "Evaluated to 2\n", "Evaluated to -4\n", "Evaluated to 2\n", "Evaluated to -4\n"},
+         {}},
+        {"divide-by-zero-traps",
+         {"--jit", "-O2"},
+         "def div(x y) x / y\n"
+         "div(1, 0)\n",
+         {},
+         {},
+         /*EmitsIR=*/false,
+         /*Traps=*/true},
+        // --overflow=undefined marks + - * and << nsw; the default does not.
+        {"overflow-undefined",
+         {"-O0", "--overflow=undefined", "-S", "--emit-llvm"},
+         "def f(x y) (x + y) * (x - y) << y\n",
+         {"add nsw i32", "sub nsw i32", "mul nsw i32", "shl nsw i32"},
+         {},
+         /*EmitsIR=*/true},
+        {"overflow-wrap",
+         {"-O0", "-S", "--emit-llvm"},
+         "def f(x y) (x + y) * (x - y) << y\n",
+         {"add i32", "sub i32", "mul i32", "shl i32"},
+         {"nsw"},
+         /*EmitsIR=*/true},
+};
+
+bool runCase(const Case &C) {
+    llvm::SmallString<128> Source, Stdout, IR;
+    int FD;
+    if (llvm::sys::fs::createTemporaryFile("toyc-test", "toy", FD, Source) ||
+        llvm::sys::fs::createTemporaryFile("toyc-test", "out", Stdout) ||
+        llvm::sys::fs::createTemporaryFile("toyc-test", "ll", IR)) {
+        std::fprintf(stderr, "error: cannot create temporary files\n");
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << C.Source;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 8> Args{TOYC_PATH};
+    Args.append(C.Args.begin(), C.Args.end());
+    if (C.EmitsIR)
+        Args.append({"-o", IR});
+    Args.push_back(Source);
+    llvm::Optional<llvm::StringRef> Redirects[] = {llvm::None, llvm::StringRef(Stdout), llvm::None};
+    std::string Error;
+    int Status = llvm::sys::ExecuteAndWait(TOYC_PATH, Args, llvm::None, Redirects, 0, 0, &Error);
+
+    auto Buffer = llvm::MemoryBuffer::getFile(C.EmitsIR ? IR : Stdout);
+    llvm::sys::fs::remove(Source);
+    llvm::sys::fs::remove(Stdout);
+    llvm::sys::fs::remove(IR);
+
+    // ExecuteAndWait returns -2 when the child was killed by a signal.
+    if (C.Traps) {
+        bool Ok = Status == -2;
+        std::fprintf(stderr, Ok ? "PASS %s\n" : "FAIL %s: did not trap\n", C.Name);
+        return Ok;
+    }
+    bool Ok = Status == 0 && Buffer;
+    if (!Ok)
+        std::fprintf(stderr, "FAIL %s: exit status %d %s\n", C.Name, Status, Error.c_str());
+    llvm::StringRef Output = Buffer ? (*Buffer)->getBuffer() : "";
+    size_t From = 0;
+    for (const char *Text : C.Expected) {
+        size_t At = Output.find(Text, From);
+        if (At == llvm::StringRef::npos) {
+            std::fprintf(stderr, "FAIL %s: missing '%s'\n", C.Name, Text);
+            Ok = false;
+        } else {
+            From = At + llvm::StringRef(Text).size();
+        }
+    }
+    for (const char *Text : C.Unexpected)
+        if (Output.contains(Text)) {
+            std::fprintf(stderr, "FAIL %s: unexpected '%s'\n", C.Name, Text);
+            Ok = false;
+        }
+    if (Ok)
+        std::fprintf(stderr, "PASS %s\n", C.Name);
+    return Ok;
+}
+
+} // end anonymous namespace
+
+int main() {
+    bool Ok = true;
+    for (const Case &C : Cases)
+        Ok &= runCase(C);
+    return Ok ? 0 : 1;
+}